@@ -3,9 +3,10 @@
  *
  *  A quick example of generating a QR code.
  *
- *  This prints the QR code to the serial monitor as solid blocks. Each module
- *  is two characters wide, since the monospace font used in the serial monitor
- *  is approximately twice as tall as wide.
+ *  This prints the QR code to the serial monitor as solid blocks. Each character
+ *  is a module wide and two modules tall (using the UTF-8 half blocks), since the
+ *  monospace font used in the serial monitor is approximately twice as tall as
+ *  wide.
  *
  */
 
@@ -28,27 +29,13 @@ void setup() {
     Serial.print(dt);
     Serial.print("\n");
 
-    // Top quiet zone
-    Serial.print("\n\n\n\n");
-
-    for (uint8_t y = 0; y < qrcode.size; y++) {
-
-        // Left quiet zone
-        Serial.print("        ");
-
-        // Each horizontal module
-        for (uint8_t x = 0; x < qrcode.size; x++) {
-
-            // Print each module (UTF-8 \u2588 is a solid block)
-            Serial.print(qrcode_getModule(&qrcode, x, y) ? "\u2588\u2588": "  ");
-
-        }
-
-        Serial.print("\n");
+    // Each line draws two rows of modules, including a 4 module quiet zone all
+    // around (use TEXT_ASCII if the serial monitor does not show UTF-8)
+    char line[qrcode_getTextLineSize(&qrcode, 4)];
+    for (uint8_t i = 0; i < (qrcode.size + 8 + 1) / 2; i++) {
+        qrcode_getTextLine(&qrcode, i, 4, TEXT_HALF_BLOCKS, line);
+        Serial.print(line);
     }
-
-    // Bottom quiet zone
-    Serial.print("\n\n\n\n");
 }
 
 void loop() {
@@ -31,9 +31,20 @@
 
 #include "qrcode.h"
 
+#include <assert.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if USE_PTHREADS
+#include <pthread.h>
+#endif
+
+#if FAST_CLASSIFY && defined(__SSE2__)
+#include <emmintrin.h>
+#elif FAST_CLASSIFY && defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #pragma mark - Error Correction Lookup tables
 
 #if LOCK_VERSION == 0
@@ -84,6 +95,18 @@ static const uint16_t NUM_RAW_DATA_MODULES = 567;
 #endif
 
 
+// Statistics counters (and the template cache) may be updated from several threads at once
+#if defined(__GNUC__) && !defined(__AVR__)
+#define ATOMIC_INCREMENT(value)  __atomic_fetch_add(&(value), 1, __ATOMIC_RELAXED)
+#define ATOMIC_LOAD(value)       __atomic_load_n(&(value), __ATOMIC_RELAXED)
+#define ATOMIC_LOAD_ACQUIRE(value)  __atomic_load_n(&(value), __ATOMIC_ACQUIRE)
+#else
+#define ATOMIC_INCREMENT(value)  ((value)++)
+#define ATOMIC_LOAD(value)       (value)
+#define ATOMIC_LOAD_ACQUIRE(value)  (value)
+#endif
+
+
 static int max(int a, int b) {
     if (a > b) { return a; }
     return b;
@@ -97,8 +120,83 @@ static int abs(int value) {
 */
 
 
+#pragma mark - Data
+
+// The data to encode, which may be split into several parts (read in order, as if they were
+// joined); contiguous data is a single part
+typedef struct DataParts {
+    const uint8_t *const *parts;
+    const uint16_t *lengths;
+    uint8_t count;
+    uint16_t length;       // Of all the parts together
+} DataParts;
+
+// A position in DataParts, which only moves forwards
+typedef struct DataCursor {
+    const DataParts *data;
+    uint8_t part;
+    uint16_t offset;
+} DataCursor;
+
+static void cursor_init(DataCursor *cursor, const DataParts *data) {
+    cursor->data = data;
+    cursor->part = 0;
+    cursor->offset = 0;
+}
+
+// Points bytes at the next run of up to length bytes within a single part, and moves past
+// them; at least one byte must remain. Returns the number of bytes in the run.
+static uint16_t cursor_read(DataCursor *cursor, const uint8_t **bytes, uint16_t length) {
+    const DataParts *data = cursor->data;
+    while (cursor->offset == data->lengths[cursor->part]) {
+        cursor->part++;
+        cursor->offset = 0;
+    }
+    
+    uint16_t available = data->lengths[cursor->part] - cursor->offset;
+    if (length > available) { length = available; }
+    *bytes = &data->parts[cursor->part][cursor->offset];
+    cursor->offset += length;
+    return length;
+}
+
+static uint8_t cursor_next(DataCursor *cursor) {
+    const uint8_t *byte;
+    cursor_read(cursor, &byte, 1);
+    return *byte;
+}
+
+
 #pragma mark - Mode testing and conversion
 
+#if FAST_CLASSIFY
+
+// The alphanumeric value of each byte, or -1; only the digits have values below 10
+static const int8_t ALPHANUMERIC_VALUES[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    36, -1, -1, -1, 37, 38, -1, -1, -1, -1, 39, 40, -1, 41, 42, 43,
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 44, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24,
+    25, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+static int8_t getAlphanumeric(char c) {
+    return ALPHANUMERIC_VALUES[(uint8_t)c];
+}
+
+#else
+
 static int8_t getAlphanumeric(char c) {
     
     if (c >= '0' && c <= '9') { return (c - '0'); }
@@ -119,22 +217,112 @@ static int8_t getAlphanumeric(char c) {
     return -1;
 }
 
-static bool isAlphanumeric(const char *text, uint16_t length) {
-    while (length != 0) {
-        if (getAlphanumeric(text[--length]) == -1) { return false; }
+#endif
+
+#if FAST_CLASSIFY && defined(__SSE2__)
+
+#define CLASSIFY_BLOCK_SIZE  16
+
+// Whether each byte is in [low, high]; the comparisons are signed, so bytes of 0x80 and
+// above (negative) are never in range
+static __m128i sse_inRange(__m128i c, char low, char high) {
+    return _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8(low - 1)), _mm_cmplt_epi8(c, _mm_set1_epi8(high + 1)));
+}
+
+// Returns the narrowest of numeric, alphanumeric and byte mode that fits all 16 bytes
+static uint8_t getBlockMode(const uint8_t *text) {
+    __m128i c = _mm_loadu_si128((const __m128i*)text);
+    
+    __m128i digits = sse_inRange(c, '0', '9');
+    __m128i others = _mm_or_si128(sse_inRange(c, 'A', 'Z'), _mm_cmpeq_epi8(c, _mm_set1_epi8(':')));
+    others = _mm_or_si128(others, _mm_cmpeq_epi8(c, _mm_set1_epi8(' ')));
+    others = _mm_or_si128(others, sse_inRange(c, '$', '%'));
+    others = _mm_or_si128(others, sse_inRange(c, '*', '+'));
+    others = _mm_or_si128(others, sse_inRange(c, '-', '/'));
+    
+    if (_mm_movemask_epi8(_mm_or_si128(digits, others)) != 0xFFFF) { return MODE_BYTE; }
+    if (_mm_movemask_epi8(digits) != 0xFFFF) { return MODE_ALPHANUMERIC; }
+    return MODE_NUMERIC;
+}
+
+#elif FAST_CLASSIFY && defined(__aarch64__) && defined(__ARM_NEON)
+
+#define CLASSIFY_BLOCK_SIZE  16
+
+// Whether each byte is in [low, high] (as (c - low) <= (high - low), unsigned)
+static uint8x16_t neon_inRange(uint8x16_t c, uint8_t low, uint8_t high) {
+    return vcleq_u8(vsubq_u8(c, vdupq_n_u8(low)), vdupq_n_u8(high - low));
+}
+
+// Returns the narrowest of numeric, alphanumeric and byte mode that fits all 16 bytes
+static uint8_t getBlockMode(const uint8_t *text) {
+    uint8x16_t c = vld1q_u8(text);
+    
+    uint8x16_t digits = neon_inRange(c, '0', '9');
+    uint8x16_t others = vorrq_u8(neon_inRange(c, 'A', 'Z'), vceqq_u8(c, vdupq_n_u8(':')));
+    others = vorrq_u8(others, vceqq_u8(c, vdupq_n_u8(' ')));
+    others = vorrq_u8(others, neon_inRange(c, '$', '%'));
+    others = vorrq_u8(others, neon_inRange(c, '*', '+'));
+    others = vorrq_u8(others, neon_inRange(c, '-', '/'));
+    
+    if (vminvq_u8(vorrq_u8(digits, others)) == 0) { return MODE_BYTE; }
+    if (vminvq_u8(digits) == 0) { return MODE_ALPHANUMERIC; }
+    return MODE_NUMERIC;
+}
+
+#endif
+
+// Returns the narrowest of numeric, alphanumeric and byte mode that fits all of the text,
+// in a single pass which stops at the first byte-only character
+static uint8_t getTextMode(const uint8_t *text, uint16_t length) {
+    uint8_t mode = MODE_NUMERIC;
+    uint16_t i = 0;
+    
+#ifdef CLASSIFY_BLOCK_SIZE
+    for (; i + CLASSIFY_BLOCK_SIZE <= length && mode != MODE_BYTE; i += CLASSIFY_BLOCK_SIZE) {
+        mode = max(mode, getBlockMode(&text[i]));
     }
-    return true;
+#endif
+    
+    for (; i < length && mode != MODE_BYTE; i++) {
+        int8_t value = getAlphanumeric((char)text[i]);
+        if (value < 0) {
+            mode = MODE_BYTE;
+        } else if (value >= 10) {
+            mode = MODE_ALPHANUMERIC;
+        }
+    }
+    
+    return mode;
 }
 
+// Whether the two bytes are a Shift JIS double-byte character in the Kanji mode ranges
+// (0x8140 - 0x9FFC and 0xE040 - 0xEBBF)
+static bool isKanjiPair(uint8_t first, uint8_t second) {
+    if (second < 0x40 || second > 0xFC || second == 0x7F) { return false; }
+    if (first >= 0x81 && first <= 0x9F) { return true; }
+    if (first >= 0xE0 && first <= 0xEA) { return true; }
+    return (first == 0xEB && second <= 0xBF);
+}
 
-static bool isNumeric(const char *text, uint16_t length) {
-    while (length != 0) {
-        char c = text[--length];
-        if (c < '0' || c > '9') { return false; }
+static bool isKanji(const DataParts *data) {
+    if (data->length % 2) { return false; }
+    
+    DataCursor cursor;
+    cursor_init(&cursor, data);
+    for (uint16_t i = 0; i < data->length; i += 2) {
+        uint8_t first = cursor_next(&cursor);
+        if (!isKanjiPair(first, cursor_next(&cursor))) { return false; }
     }
     return true;
 }
 
+// Returns the 13-bit Kanji mode value of a double-byte character (see isKanjiPair)
+static uint16_t getKanji(uint8_t first, uint8_t second) {
+    uint16_t value = ((first << 8) | second) - ((first <= 0x9F) ? 0x8140: 0xC140);
+    return (value >> 8) * 0xC0 + (value & 0xFF);
+}
+
 
 #pragma mark - Counting
 
@@ -143,25 +331,190 @@ static bool isNumeric(const char *text, uint16_t length) {
 // NUMERIC      ( 10,   12,    14);
 // ALPHANUMERIC (  9,   11,    13);
 // BYTE         (  8,   16,    16);
+// KANJI        (  8,   10,    12);  (not packed; 8 + 2 per size step)
 static char getModeBits(uint8_t version, uint8_t mode) {
     // Note: We use 15 instead of 16; since 15 doesn't exist and we cannot store 16 (8 + 8) in 3 bits
     // hex(int("".join(reversed([('00' + bin(x - 8)[2:])[-3:] for x in [10, 9, 8, 12, 11, 15, 14, 13, 15]])), 2))
     unsigned int modeInfo = 0x7bbb80a;
+    uint8_t kanjiBits = 8;
     
 #if LOCK_VERSION == 0 || LOCK_VERSION > 9
-    if (version > 9) { modeInfo >>= 9; }
+    if (version > 9) { modeInfo >>= 9; kanjiBits += 2; }
+#else
+    (void)version;
 #endif
     
 #if LOCK_VERSION == 0 || LOCK_VERSION > 26
-    if (version > 26) { modeInfo >>= 9; }
+    if (version > 26) { modeInfo >>= 9; kanjiBits += 2; }
 #endif
     
+    if (mode == MODE_KANJI) { return kanjiBits; }
+    
     char result = 8 + ((modeInfo >> (3 * mode)) & 0x07);
     if (result == 15) { result = 16; }
     
     return result;
 }
 
+// Returns the number of bits the ECI header for the assignment number takes (the mode
+// indicator and a 1 to 3 byte designator), or 0 for none
+static uint8_t getEciBits(uint32_t eci) {
+    if (eci == 0) { return 0; }
+    if (eci < (1 << 7)) { return 4 + 8; }
+    if (eci < (1 << 14)) { return 4 + 16; }
+    return 4 + 24;
+}
+
+
+#pragma mark - Segmentation
+
+// Returns the mode every character of the data can be encoded in (Kanji only if allowed)
+static uint8_t getDataMode(const DataParts *data, bool kanji) {
+    uint8_t mode = MODE_NUMERIC;
+    for (uint8_t i = 0; i < data->count && mode != MODE_BYTE; i++) {
+        mode = max(mode, getTextMode(data->parts[i], data->lengths[i]));
+    }
+    
+    if (mode == MODE_BYTE && kanji && isKanji(data)) { return MODE_KANJI; }
+    return mode;
+}
+
+// Returns the number of bits a segment of length bytes takes at the given version, including
+// its header, or UINT32_MAX if its characters do not fit in the character count field
+static uint32_t getSegmentBits(uint8_t mode, uint16_t length, uint8_t version) {
+    if (mode == MODE_KANJI) { length /= 2; }
+    
+    uint8_t modeBits = getModeBits(version, mode);
+    if ((length >> modeBits) != 0) { return UINT32_MAX; }
+    
+    uint32_t bits;
+    switch (mode) {
+        case MODE_NUMERIC:
+            bits = 10 * (length / 3) + ((length % 3) ? (length % 3) * 3 + 1: 0);
+            break;
+        case MODE_ALPHANUMERIC:
+            bits = 11 * (length / 2) + 6 * (length % 2);
+            break;
+        case MODE_KANJI:
+            bits = 13 * (uint32_t)length;
+            break;
+        default:
+            bits = 8 * (uint32_t)length;
+            break;
+    }
+    
+    return 4 + modeBits + bits;
+}
+
+// The modes tried by segmentData, in order of preference on ties (as Nayuki's)
+static const uint8_t SEGMENT_MODES[4] = { MODE_BYTE, MODE_ALPHANUMERIC, MODE_NUMERIC, MODE_KANJI };
+
+// The cost of each character (by mode), in sixths of a bit so each is whole; a double-byte
+// character costs twice the byte cost in byte mode
+static const uint8_t SEGMENT_CHARACTER_COSTS[4] = { 20, 33, 48, 78 };
+
+// Marks the second byte of a double-byte character in segmentData; this is never a valid entry
+// for a single-byte character, which cannot itself be in Kanji mode (the top 2 bits)
+#define SEGMENT_CONTINUATION   0xFF
+
+// Chooses the mode of each character, such that the data (split into a segment per run of
+// characters in the same mode) encodes to about the fewest bits at the given version. This is
+// the dynamic programme of Nayuki's QrSegmentAdvanced. While it runs, charModes[i] holds the
+// mode of character i for each mode the next character may be in (2 bits each); it is then
+// resolved into the chosen mode. If kanji is set, the data is read as Shift JIS, where each
+// double-byte character is a single character.
+static void segmentData(const DataParts *data, uint8_t version, bool kanji, uint8_t *charModes) {
+    uint16_t length = data->length;
+    uint8_t modeCount = kanji ? 4: 3;
+    
+    uint32_t headCosts[4], costs[4];
+    for (uint8_t mode = 0; mode < modeCount; mode++) {
+        headCosts[mode] = (4 + getModeBits(version, mode)) * 6;
+        costs[mode] = headCosts[mode];
+    }
+    
+    // Each character is read along with the byte after it, in case it is double-byte
+    DataCursor cursor;
+    cursor_init(&cursor, data);
+    uint8_t next = (length > 0) ? cursor_next(&cursor): 0;
+    
+    for (uint16_t i = 0; i < length; i++) {
+        char c = next;
+        next = (i + 1 < length) ? cursor_next(&cursor): 0;
+        bool doubleByte = (kanji && i + 1 < length && isKanjiPair(c, next));
+        
+        bool valid[4];
+        int8_t value = getAlphanumeric(c);
+        valid[MODE_NUMERIC] = (value >= 0 && value < 10);
+        valid[MODE_ALPHANUMERIC] = (value >= 0);
+        valid[MODE_BYTE] = true;
+        valid[MODE_KANJI] = doubleByte;
+        
+        // Continue the current segment of each mode
+        uint8_t modes = 0;
+        for (uint8_t mode = 0; mode < modeCount; mode++) {
+            if (valid[mode]) {
+                costs[mode] += SEGMENT_CHARACTER_COSTS[mode] * ((doubleByte && mode == MODE_BYTE) ? 2: 1);
+                modes |= mode << (2 * mode);
+            } else {
+                costs[mode] = UINT32_MAX;
+            }
+        }
+        
+        // Or end it (rounded up to a whole bit) and start a segment of another mode
+        for (uint8_t j = 0; j < modeCount; j++) {
+            uint8_t to = SEGMENT_MODES[j];
+            for (uint8_t k = 0; k < modeCount; k++) {
+                uint8_t from = SEGMENT_MODES[k];
+                if (costs[from] == UINT32_MAX) { continue; }
+                
+                uint32_t cost = (costs[from] + 5) / 6 * 6 + headCosts[to];
+                if (costs[to] == UINT32_MAX || cost < costs[to]) {
+                    costs[to] = cost;
+                    modes = (modes & ~(0x03 << (2 * to))) | (from << (2 * to));
+                }
+            }
+        }
+        
+        charModes[i] = modes;
+        if (doubleByte) {
+            charModes[++i] = SEGMENT_CONTINUATION;
+            next = (i + 1 < length) ? cursor_next(&cursor): 0;
+        }
+    }
+    
+    // Follow the cheapest path back from the end
+    uint8_t mode = 0;
+    uint32_t minCost = UINT32_MAX;
+    for (uint8_t j = 0; j < modeCount; j++) {
+        if (costs[SEGMENT_MODES[j]] < minCost) {
+            mode = SEGMENT_MODES[j];
+            minCost = costs[mode];
+        }
+    }
+    
+    for (uint16_t i = length; i > 0; ) {
+        // The entry of a double-byte character is on its first byte
+        uint16_t start = (charModes[i - 1] == SEGMENT_CONTINUATION) ? i - 2: i - 1;
+        mode = (charModes[start] >> (2 * mode)) & 0x03;
+        for (; i > start; i--) { charModes[i - 1] = mode; }
+    }
+}
+
+// Returns the number of bits the data takes at the given version when split into a segment per
+// run of characters in the same mode (see segmentData), or UINT32_MAX if any is too long
+static uint32_t getSegmentedBits(const uint8_t *charModes, uint16_t length, uint8_t version) {
+    uint32_t bits = 0;
+    for (uint16_t start = 0, end; start < length; start = end) {
+        for (end = start + 1; end < length && charModes[end] == charModes[start]; end++) { }
+        
+        uint32_t segmentBits = getSegmentBits(charModes[start], end - start, version);
+        if (segmentBits == UINT32_MAX) { return UINT32_MAX; }
+        bits += segmentBits;
+    }
+    return bits;
+}
+
 
 #pragma mark - BitBucket
 
@@ -206,13 +559,38 @@ static void bb_initGrid(BitBucket *bitGrid, uint8_t *data, uint8_t size) {
     memset(data, 0, bitGrid->capacityBytes);
 }
 
+// Appends the low length bits of val; the buffer starts zeroed, so each byte they span
+// is filled with a single OR
 static void bb_appendBits(BitBucket *bitBuffer, uint32_t val, uint8_t length) {
     uint32_t offset = bitBuffer->bitOffsetOrWidth;
-    for (int8_t i = length - 1; i >= 0; i--, offset++) {
-        bitBuffer->data[offset >> 3] |= ((val >> i) & 1) << (7 - (offset & 7));
+    while (length > 0) {
+        uint8_t space = 8 - (offset & 7);
+        uint8_t count = (length < space) ? length: space;
+        length -= count;
+        bitBuffer->data[offset >> 3] |= ((val >> length) & ((1 << count) - 1)) << (space - count);
+        offset += count;
     }
     bitBuffer->bitOffsetOrWidth = offset;
 }
+
+// Appends whole bytes; copied directly when the offset is byte-aligned, otherwise each is
+// split across the partial byte and the (still zero) byte after it
+static void bb_appendBytes(BitBucket *bitBuffer, const uint8_t *bytes, uint16_t length) {
+    uint32_t offset = bitBuffer->bitOffsetOrWidth;
+    uint8_t *data = &bitBuffer->data[offset >> 3];
+    uint8_t shift = offset & 7;
+    
+    if (shift == 0) {
+        memcpy(data, bytes, length);
+    } else {
+        for (uint16_t i = 0; i < length; i++) {
+            data[i] |= bytes[i] >> shift;
+            data[i + 1] = bytes[i] << (8 - shift);
+        }
+    }
+    
+    bitBuffer->bitOffsetOrWidth = offset + 8 * (uint32_t)length;
+}
 /*
 void bb_setBits(BitBucket *bitBuffer, uint32_t val, int offset, uint8_t length) {
     for (int8_t i = length - 1; i >= 0; i--, offset++) {
@@ -230,6 +608,7 @@ static void bb_setBit(BitBucket *bitGrid, uint8_t x, uint8_t y, bool on) {
     }
 }
 
+#if !FAST_MASKING
 static void bb_invertBit(BitBucket *bitGrid, uint8_t x, uint8_t y, bool invert) {
     uint32_t offset = y * bitGrid->bitOffsetOrWidth + x;
     uint8_t mask = 1 << (7 - (offset & 0x07));
@@ -240,6 +619,7 @@ static void bb_invertBit(BitBucket *bitGrid, uint8_t x, uint8_t y, bool invert)
         bitGrid->data[offset >> 3] &= ~mask;
     }
 }
+#endif
 
 static bool bb_getBit(BitBucket *bitGrid, uint8_t x, uint8_t y) {
     uint32_t offset = y * bitGrid->bitOffsetOrWidth + x;
@@ -247,8 +627,136 @@ static bool bb_getBit(BitBucket *bitGrid, uint8_t x, uint8_t y) {
 }
 
 
+#pragma mark - Scratch Memory
+
+// A bump allocator over caller-provided memory. When an Arena is passed to a function, its
+// scratch buffers are taken from the arena, otherwise they are placed on the stack. Every
+// function releases what it allocated before returning (see SCRATCH_RELEASE).
+typedef struct Arena {
+    uint8_t *data;
+    uint32_t used;
+    uint32_t capacity;
+} Arena;
+
+// Allocations are 8-byte aligned (for the penalty scorer's words); callers size arenas with
+// arena_getSize (see getScratchSize), so an allocation never fails
+static uint8_t* arena_alloc(Arena *arena, uint32_t size) {
+    uintptr_t address = ((uintptr_t)&arena->data[arena->used] + 7) & ~(uintptr_t)7;
+    arena->used = (uint32_t)(address - (uintptr_t)arena->data) + size;
+    assert(arena->used <= arena->capacity);
+    return (uint8_t*)address;
+}
+
+// The arena space needed for an allocation of size bytes, including alignment
+static uint32_t arena_getSize(uint32_t size) {
+    return size + 7;
+}
+
+// Declares a scratch buffer of count elements named name, from the arena if non-NULL,
+// otherwise on the stack
+#define SCRATCH_BUFFER(type, name, count, arena) \
+    type name##Stack[(arena) ? 1: (count)]; \
+    type *name = (arena) ? (type*)arena_alloc((arena), sizeof(type) * (count)): name##Stack
+
+#define SCRATCH_MARK(arena)      uint32_t arenaMark = (arena) ? (arena)->used: 0
+#define SCRATCH_RELEASE(arena)   if (arena) { (arena)->used = arenaMark; }
+
+
 #pragma mark - Drawing Patterns
 
+// Returns whether the given mask pattern inverts the module at (x, y)
+static bool getMaskBit(uint8_t mask, uint8_t x, uint8_t y) {
+    switch (mask) {
+        case 0:  return (x + y) % 2 == 0;
+        case 1:  return y % 2 == 0;
+        case 2:  return x % 3 == 0;
+        case 3:  return (x + y) % 3 == 0;
+        case 4:  return (x / 3 + y / 2) % 2 == 0;
+        case 5:  return x * y % 2 + x * y % 3 == 0;
+        case 6:  return (x * y % 2 + x * y % 3) % 2 == 0;
+        case 7:  return ((x + y) % 2 + x * y % 3) % 2 == 0;
+    }
+    return false;
+}
+
+#if FAST_MASKING
+
+// Fills maskGrid with the given mask pattern, restricted to the data modules (those not
+// set in isFunction), so masking a grid is a plain XOR with maskGrid (see applyMask).
+static void buildMaskGrid(BitBucket *maskGrid, BitBucket *isFunction, uint8_t mask) {
+    uint8_t size = maskGrid->bitOffsetOrWidth;
+    uint8_t *data = maskGrid->data;
+    
+    memset(data, 0, maskGrid->capacityBytes);
+    
+    uint8_t rowLength = (size + 7) / 8;
+    uint8_t row[(177 + 7) / 8];
+    
+    uint32_t offset = 0;
+    for (uint8_t y = 0; y < size; y++, offset += size) {
+        
+        // Every mask repeats every 6 columns, so each row (from x = 0) repeats every 3 bytes
+        for (uint8_t i = 0; i < 3; i++) {
+            uint8_t bits = 0;
+            for (uint8_t x = 8 * i; x < 8 * i + 8; x++) {
+                bits = (bits << 1) | getMaskBit(mask, x, y);
+            }
+            row[i] = bits;
+        }
+        for (uint8_t i = 3; i < rowLength; i++) {
+            row[i] = row[i - 3];
+        }
+        row[rowLength - 1] &= 0xff << (8 * rowLength - size);
+        
+        // Merge the row into the (unaligned) grid bitstream
+        uint8_t shift = offset & 7;
+        uint8_t *dst = &data[offset >> 3];
+        for (uint8_t i = 0; i < rowLength; i++) {
+            dst[i] |= row[i] >> shift;
+            if (shift && (row[i] << (8 - shift)) & 0xff) {
+                dst[i + 1] |= row[i] << (8 - shift);
+            }
+        }
+    }
+    
+    // Never mask function modules
+    const uint8_t *function = isFunction->data;
+    uint16_t length = maskGrid->capacityBytes, i = 0;
+    for (; i + 4 <= length; i += 4) {
+        uint32_t word, functionWord;
+        memcpy(&word, &data[i], 4);
+        memcpy(&functionWord, &function[i], 4);
+        word &= ~functionWord;
+        memcpy(&data[i], &word, 4);
+    }
+    for (; i < length; i++) {
+        data[i] &= ~function[i];
+    }
+}
+
+// XORs the data modules in this QR Code with the mask grid prepared by buildMaskGrid, a word
+// at a time. Due to XOR's mathematical properties, applying the same mask twice is equivalent
+// to no change at all. This means it is possible to apply a mask, undo it, and try another mask.
+// Note that a final well-formed QR Code symbol needs exactly one mask applied (not zero, not two, etc.).
+static void applyMask(BitBucket *modules, BitBucket *maskGrid) {
+    uint8_t *data = modules->data;
+    const uint8_t *mask = maskGrid->data;
+    
+    uint16_t length = modules->capacityBytes, i = 0;
+    for (; i + 4 <= length; i += 4) {
+        uint32_t word, maskWord;
+        memcpy(&word, &data[i], 4);
+        memcpy(&maskWord, &mask[i], 4);
+        word ^= maskWord;
+        memcpy(&data[i], &word, 4);
+    }
+    for (; i < length; i++) {
+        data[i] ^= mask[i];
+    }
+}
+
+#else
+
 // XORs the data modules in this QR Code with the given mask pattern. Due to XOR's mathematical
 // properties, calling applyMask(m) twice with the same value is equivalent to no change at all.
 // This means it is possible to apply a mask, undo it, and try another mask. Note that a final
@@ -259,26 +767,17 @@ static void applyMask(BitBucket *modules, BitBucket *isFunction, uint8_t mask) {
     for (uint8_t y = 0; y < size; y++) {
         for (uint8_t x = 0; x < size; x++) {
             if (bb_getBit(isFunction, x, y)) { continue; }
-            
-            bool invert = 0;
-            switch (mask) {
-                case 0:  invert = (x + y) % 2 == 0;                    break;
-                case 1:  invert = y % 2 == 0;                          break;
-                case 2:  invert = x % 3 == 0;                          break;
-                case 3:  invert = (x + y) % 3 == 0;                    break;
-                case 4:  invert = (x / 3 + y / 2) % 2 == 0;            break;
-                case 5:  invert = x * y % 2 + x * y % 3 == 0;          break;
-                case 6:  invert = (x * y % 2 + x * y % 3) % 2 == 0;    break;
-                case 7:  invert = ((x + y) % 2 + x * y % 3) % 2 == 0;  break;
-            }
-            bb_invertBit(modules, x, y, invert);
+            bb_invertBit(modules, x, y, getMaskBit(mask, x, y));
         }
     }
 }
 
+#endif
+
+// If isFunction is NULL, only the module is drawn (the function grid is already complete)
 static void setFunctionModule(BitBucket *modules, BitBucket *isFunction, uint8_t x, uint8_t y, bool on) {
     bb_setBit(modules, x, y, on);
-    bb_setBit(isFunction, x, y, true);
+    if (isFunction) { bb_setBit(isFunction, x, y, true); }
 }
 
 // Draws a 9*9 finder pattern including the border separator, with the center module at (x, y).
@@ -468,6 +967,24 @@ static void drawCodewords(BitBucket *modules, BitBucket *isFunction, BitBucket *
     }
 }
 
+// Same as drawCodewords, but using the offsets of buildPlacement. The data modules must
+// be clear, so only the set bits are drawn (and zero bytes are skipped entirely).
+static void drawCodewordsPlaced(BitBucket *modules, const uint16_t *placement, BitBucket *codewords) {
+    uint16_t byteLength = codewords->bitOffsetOrWidth / 8;
+    const uint8_t *data = codewords->data;
+    uint8_t *grid = modules->data;
+    
+    for (uint16_t i = 0; i < byteLength; i++, placement += 8) {
+        uint8_t byte = data[i];
+        for (uint8_t j = 0; byte; j++, byte <<= 1) {
+            if (byte & 0x80) {
+                uint16_t offset = placement[j];
+                grid[offset >> 3] |= 0x80 >> (offset & 7);
+            }
+        }
+    }
+}
+
 
 
 #pragma mark - Penalty Calculation
@@ -477,16 +994,240 @@ static void drawCodewords(BitBucket *modules, BitBucket *isFunction, BitBucket *
 #define PENALTY_N3     40
 #define PENALTY_N4     10
 
+// Returns the penalty for the balance of black and white modules, which is mask-dependent
+// but cheap, so it is added first to let the other rules stop early (see getPenaltyScore)
+static uint32_t getBalancePenalty(BitBucket *modules) {
+    uint8_t size = modules->bitOffsetOrWidth;
+    uint16_t total = size * size;
+    
+    // Count whole bytes, then the first bits of the last one (the rest is padding)
+    uint16_t black = 0;
+    for (uint16_t i = 0; i < total / 8; i++) {
+        for (uint8_t byte = modules->data[i]; byte; byte &= byte - 1) { black++; }
+    }
+    if (total % 8) {
+        for (uint8_t byte = modules->data[total / 8] & (0xFF << (8 - total % 8)); byte; byte &= byte - 1) { black++; }
+    }
+    
+    // Find smallest k such that (45-5k)% <= dark/total <= (55+5k)%
+    uint32_t result = 0;
+    for (uint16_t k = 0; black * 20 < (9 - k) * total || black * 20 > (11 + k) * total; k++) {
+        result += PENALTY_N4;
+    }
+    return result;
+}
+
+#if FAST_PENALTY
+
+// The penalty is computed on rows unpacked into 64-bit words, most significant bit first,
+// so module x of a row is bit (63 - x % 64) of word x / 64. Columns are scored 64 at a
+// time alongside the rows, comparing each row with the ones above it. Every rule then
+// reduces to shifts, boolean operations and population counts over at most 3 words per row.
+
+#define PENALTY_MAX_WORDS    ((177 + 63) / 64)
+
+static uint8_t popcount64(uint64_t value) {
+#if defined(__GNUC__)
+    return __builtin_popcountll(value);
+#else
+    value -= (value >> 1) & 0x5555555555555555ULL;
+    value = (value & 0x3333333333333333ULL) + ((value >> 2) & 0x3333333333333333ULL);
+    value = (value + (value >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (value * 0x0101010101010101ULL) >> 56;
+#endif
+}
+
+// Sets dst[x] = src[x - shift] (0 for x < shift), for 0 < shift < 64
+static void pr_shift(uint64_t *dst, const uint64_t *src, uint8_t words, uint8_t shift) {
+    for (uint8_t k = words - 1; k > 0; k--) {
+        dst[k] = (src[k] >> shift) | (src[k - 1] << (64 - shift));
+    }
+    dst[0] = src[0] >> shift;
+}
+
+// Sets the bits [from, to) and clears all others
+static void pr_range(uint64_t *dst, uint8_t words, uint8_t from, uint8_t to) {
+    for (uint8_t k = 0; k < words; k++) {
+        uint64_t word = 0;
+        for (uint8_t x = 0; x < 64; x++) {
+            uint16_t position = 64 * k + x;
+            if (position >= from && position < to) { word |= 1ULL << (63 - x); }
+        }
+        dst[k] = word;
+    }
+}
+
+// Unpacks each row of the grid into words; rows must hold size rows of words each
+static void unpackRows(BitBucket *modules, uint64_t *rows, uint8_t words) {
+    uint8_t size = modules->bitOffsetOrWidth;
+    const uint8_t *data = modules->data;
+    uint16_t length = modules->capacityBytes;
+    
+    uint32_t offset = 0;
+    for (uint8_t y = 0; y < size; y++, offset += size) {
+        uint64_t *row = &rows[y * words];
+        for (uint8_t k = 0; 64 * k < size; k++) {
+            uint32_t bit = offset + 64 * k;
+            uint16_t index = bit >> 3;
+            uint8_t shift = bit & 7;
+            
+            // Load 9 bytes big-endian, then align to the first bit of this word
+            uint64_t word = 0;
+            for (uint8_t i = 0; i < 8; i++) {
+                word = (word << 8) | ((index + i < length) ? data[index + i]: 0);
+            }
+            if (shift) {
+                uint8_t next = (index + 8 < length) ? data[index + 8]: 0;
+                word = (word << shift) | (next >> (8 - shift));
+            }
+            
+            // Clear the bits belonging to the next row
+            uint8_t remaining = size - 64 * k;
+            if (remaining < 64) { word &= ~(0xFFFFFFFFFFFFFFFFULL >> remaining); }
+            
+            row[k] = word;
+        }
+    }
+}
+
+// Adds the penalties for runs of 5 or more same-colored modules and for finder-like patterns
+// in a single row (or column). Sets same[x] when module x matches module x - 1.
+static uint32_t getLinePenalty(const uint64_t *line, uint64_t *same, uint8_t words, const uint64_t *valid1, const uint64_t *valid10) {
+    uint32_t result = 0;
+    
+    uint64_t shifted[11][PENALTY_MAX_WORDS];
+    for (uint8_t n = 1; n <= 10; n++) {
+        pr_shift(shifted[n], line, words, n);
+    }
+    
+    uint64_t run[PENALTY_MAX_WORDS];
+    for (uint8_t k = 0; k < words; k++) {
+        same[k] = ~(line[k] ^ shifted[1][k]) & valid1[k];
+    }
+    
+    // A run of length L >= 5 has L - 1 >= 4 consecutive "same" bits and costs L - 2; with
+    // run[x] marking 4 consecutive same bits ending at x, that is popcount + 2 per run.
+    uint64_t same1[PENALTY_MAX_WORDS], same2[PENALTY_MAX_WORDS], same3[PENALTY_MAX_WORDS];
+    pr_shift(same1, same, words, 1);
+    pr_shift(same2, same, words, 2);
+    pr_shift(same3, same, words, 3);
+    for (uint8_t k = 0; k < words; k++) {
+        run[k] = same[k] & same1[k] & same2[k] & same3[k];
+    }
+    
+    uint64_t runPrevious[PENALTY_MAX_WORDS];
+    pr_shift(runPrevious, run, words, 1);
+    for (uint8_t k = 0; k < words; k++) {
+        result += popcount64(run[k]);
+        result += (PENALTY_N1 - 1) * popcount64(run[k] & ~runPrevious[k]);
+    }
+    
+    // Finder-like patterns: the 11 modules ending at x are 00001011101 or 10111010000
+    for (uint8_t k = 0; k < words; k++) {
+        uint64_t before = valid10[k], after = valid10[k];
+        for (uint8_t n = 0; n <= 10; n++) {
+            uint64_t bits = (n == 0) ? line[k]: shifted[n][k];
+            before &= ((0x05D >> n) & 1) ? bits: ~bits;
+            after &= ((0x5D0 >> n) & 1) ? bits: ~bits;
+        }
+        result += PENALTY_N3 * (popcount64(before) + popcount64(after));
+    }
+    
+    return result;
+}
+
 // Calculates and returns the penalty score based on state of this QR Code's current modules.
 // This is used by the automatic mask choice algorithm to find the mask pattern that yields the lowest score.
-// @TODO: This can be optimized by working with the bytes instead of bits.
-static uint32_t getPenaltyScore(BitBucket *modules) {
-    uint32_t result = 0;
+// As every rule only adds to the score, it stops early once the score reaches limit (so it
+// cannot beat the best candidate so far), returning a score of at least limit.
+static uint32_t getPenaltyScore(BitBucket *modules, uint32_t limit, Arena *arena) {
+    uint32_t result = getBalancePenalty(modules);
+    if (result >= limit) { return result; }
+    
+    uint8_t size = modules->bitOffsetOrWidth;
+    uint8_t words = (size + 63) / 64;
+    
+    SCRATCH_MARK(arena);
+    SCRATCH_BUFFER(uint64_t, rows, size * words, arena);
+    unpackRows(modules, rows, words);
+    
+    uint64_t valid[PENALTY_MAX_WORDS], valid1[PENALTY_MAX_WORDS], valid10[PENALTY_MAX_WORDS];
+    pr_range(valid, words, 0, size);
+    pr_range(valid1, words, 1, size);
+    pr_range(valid10, words, 10, size);
+    
+    // For the columns, sameAbove[y % 4] marks the modules matching the one above in each of
+    // the last 4 rows, and runAbove the runs (as in getLinePenalty) ending in the last row
+    uint64_t same[PENALTY_MAX_WORDS], sameAbove[4][PENALTY_MAX_WORDS], runAbove[PENALTY_MAX_WORDS];
+    uint64_t blocksPrevious[PENALTY_MAX_WORDS];
+    memset(sameAbove, 0, sizeof(sameAbove));
+    memset(runAbove, 0, sizeof(runAbove));
+    
+    for (uint8_t y = 0; y < size && result < limit; y++) {
+        const uint64_t *row = &rows[y * words];
+        
+        // Adjacent modules in row having same color, and finder-like patterns
+        result += getLinePenalty(row, same, words, valid1, valid10);
+        
+        if (y == 0) { continue; }
+        const uint64_t *above = &rows[(y - 1) * words];
+        uint64_t *sameColumn = sameAbove[y % 4];
+        
+        for (uint8_t k = 0; k < words; k++) {
+            sameColumn[k] = ~(row[k] ^ above[k]) & valid[k];
+            
+            // Adjacent modules in column having same color
+            uint64_t run = sameColumn[k] & sameAbove[(y + 3) % 4][k] & sameAbove[(y + 2) % 4][k] & sameAbove[(y + 1) % 4][k];
+            result += popcount64(run);
+            result += (PENALTY_N1 - 1) * popcount64(run & ~runAbove[k]);
+            runAbove[k] = run;
+            
+            // Finder-like patterns in columns, ending in this row
+            if (y >= 10) {
+                uint64_t before = valid[k], after = valid[k];
+                for (uint8_t n = 0; n <= 10; n++) {
+                    uint64_t bits = rows[(y - n) * words + k];
+                    before &= ((0x05D >> n) & 1) ? bits: ~bits;
+                    after &= ((0x5D0 >> n) & 1) ? bits: ~bits;
+                }
+                result += PENALTY_N3 * (popcount64(before) + popcount64(after));
+            }
+        }
+        
+        // 2*2 blocks of modules having same color: row y matches row y - 1 at x and x - 1,
+        // and module x matches module x - 1
+        pr_shift(blocksPrevious, sameColumn, words, 1);
+        for (uint8_t k = 0; k < words; k++) {
+            result += PENALTY_N2 * popcount64(sameColumn[k] & blocksPrevious[k] & same[k]);
+        }
+    }
+    
+    SCRATCH_RELEASE(arena);
+    
+    return result;
+}
+
+// The scratch memory used by getPenaltyScore
+static uint32_t getPenaltyScratchSize(uint8_t size) {
+    uint8_t words = (size + 63) / 64;
+    return arena_getSize(size * words * sizeof(uint64_t));
+}
+
+#else
+
+// Calculates and returns the penalty score based on state of this QR Code's current modules.
+// This is used by the automatic mask choice algorithm to find the mask pattern that yields the lowest score.
+// As every rule only adds to the score, it stops early once the score reaches limit (so it
+// cannot beat the best candidate so far), returning a score of at least limit.
+static uint32_t getPenaltyScore(BitBucket *modules, uint32_t limit, Arena *arena) {
+    (void)arena;
+    
+    uint32_t result = getBalancePenalty(modules);
     
     uint8_t size = modules->bitOffsetOrWidth;
     
     // Adjacent modules in row having same color
-    for (uint8_t y = 0; y < size; y++) {
+    for (uint8_t y = 0; y < size && result < limit; y++) {
         
         bool colorX = bb_getBit(modules, 0, y);
         for (uint8_t x = 1, runX = 1; x < size; x++) {
@@ -507,7 +1248,7 @@ static uint32_t getPenaltyScore(BitBucket *modules) {
     }
     
     // Adjacent modules in column having same color
-    for (uint8_t x = 0; x < size; x++) {
+    for (uint8_t x = 0; x < size && result < limit; x++) {
         bool colorY = bb_getBit(modules, x, 0);
         for (uint8_t y = 1, runY = 1; y < size; y++) {
             bool cy = bb_getBit(modules, x, y);
@@ -525,8 +1266,7 @@ static uint32_t getPenaltyScore(BitBucket *modules) {
         }
     }
     
-    uint16_t black = 0;
-    for (uint8_t y = 0; y < size; y++) {
+    for (uint8_t y = 0; y < size && result < limit; y++) {
         uint16_t bitsRow = 0, bitsCol = 0;
         for (uint8_t x = 0; x < size; x++) {
             bool color = bb_getBit(modules, x, y);
@@ -554,35 +1294,135 @@ static uint32_t getPenaltyScore(BitBucket *modules) {
                     result += PENALTY_N3;
                 }
             }
-
-            // Balance of black and white modules
-            if (color) { black++; }
         }
     }
-
-    // Find smallest k such that (45-5k)% <= dark/total <= (55+5k)%
-    uint16_t total = size * size;
-    for (uint16_t k = 0; black * 20 < (9 - k) * total || black * 20 > (11 + k) * total; k++) {
-        result += PENALTY_N4;
-    }
     
     return result;
 }
 
+static uint32_t getPenaltyScratchSize(uint8_t size) {
+    (void)size;
+    return 0;
+}
+
+#endif
+
 
 #pragma mark - Reed-Solomon Generator
 
-static uint8_t rs_multiply(uint8_t x, uint8_t y) {
-    // Russian peasant multiplication
-    // See: https://en.wikipedia.org/wiki/Ancient_Egyptian_multiplication
-    uint16_t z = 0;
-    for (int8_t i = 7; i >= 0; i--) {
+#if RS_LOOKUP_TABLES
+
+// Powers of the generator element 0x02 in GF(2^8/0x11D). The table is repeated, so
+// the sum of two logarithms (at most 254 + 254) can be used as an index directly.
+static const uint8_t GF_EXP[512] = {
+    0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1d, 0x3a, 0x74, 0xe8, 0xcd, 0x87, 0x13, 0x26,
+    0x4c, 0x98, 0x2d, 0x5a, 0xb4, 0x75, 0xea, 0xc9, 0x8f, 0x03, 0x06, 0x0c, 0x18, 0x30, 0x60, 0xc0,
+    0x9d, 0x27, 0x4e, 0x9c, 0x25, 0x4a, 0x94, 0x35, 0x6a, 0xd4, 0xb5, 0x77, 0xee, 0xc1, 0x9f, 0x23,
+    0x46, 0x8c, 0x05, 0x0a, 0x14, 0x28, 0x50, 0xa0, 0x5d, 0xba, 0x69, 0xd2, 0xb9, 0x6f, 0xde, 0xa1,
+    0x5f, 0xbe, 0x61, 0xc2, 0x99, 0x2f, 0x5e, 0xbc, 0x65, 0xca, 0x89, 0x0f, 0x1e, 0x3c, 0x78, 0xf0,
+    0xfd, 0xe7, 0xd3, 0xbb, 0x6b, 0xd6, 0xb1, 0x7f, 0xfe, 0xe1, 0xdf, 0xa3, 0x5b, 0xb6, 0x71, 0xe2,
+    0xd9, 0xaf, 0x43, 0x86, 0x11, 0x22, 0x44, 0x88, 0x0d, 0x1a, 0x34, 0x68, 0xd0, 0xbd, 0x67, 0xce,
+    0x81, 0x1f, 0x3e, 0x7c, 0xf8, 0xed, 0xc7, 0x93, 0x3b, 0x76, 0xec, 0xc5, 0x97, 0x33, 0x66, 0xcc,
+    0x85, 0x17, 0x2e, 0x5c, 0xb8, 0x6d, 0xda, 0xa9, 0x4f, 0x9e, 0x21, 0x42, 0x84, 0x15, 0x2a, 0x54,
+    0xa8, 0x4d, 0x9a, 0x29, 0x52, 0xa4, 0x55, 0xaa, 0x49, 0x92, 0x39, 0x72, 0xe4, 0xd5, 0xb7, 0x73,
+    0xe6, 0xd1, 0xbf, 0x63, 0xc6, 0x91, 0x3f, 0x7e, 0xfc, 0xe5, 0xd7, 0xb3, 0x7b, 0xf6, 0xf1, 0xff,
+    0xe3, 0xdb, 0xab, 0x4b, 0x96, 0x31, 0x62, 0xc4, 0x95, 0x37, 0x6e, 0xdc, 0xa5, 0x57, 0xae, 0x41,
+    0x82, 0x19, 0x32, 0x64, 0xc8, 0x8d, 0x07, 0x0e, 0x1c, 0x38, 0x70, 0xe0, 0xdd, 0xa7, 0x53, 0xa6,
+    0x51, 0xa2, 0x59, 0xb2, 0x79, 0xf2, 0xf9, 0xef, 0xc3, 0x9b, 0x2b, 0x56, 0xac, 0x45, 0x8a, 0x09,
+    0x12, 0x24, 0x48, 0x90, 0x3d, 0x7a, 0xf4, 0xf5, 0xf7, 0xf3, 0xfb, 0xeb, 0xcb, 0x8b, 0x0b, 0x16,
+    0x2c, 0x58, 0xb0, 0x7d, 0xfa, 0xe9, 0xcf, 0x83, 0x1b, 0x36, 0x6c, 0xd8, 0xad, 0x47, 0x8e, 0x01,
+    0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1d, 0x3a, 0x74, 0xe8, 0xcd, 0x87, 0x13, 0x26, 0x4c,
+    0x98, 0x2d, 0x5a, 0xb4, 0x75, 0xea, 0xc9, 0x8f, 0x03, 0x06, 0x0c, 0x18, 0x30, 0x60, 0xc0, 0x9d,
+    0x27, 0x4e, 0x9c, 0x25, 0x4a, 0x94, 0x35, 0x6a, 0xd4, 0xb5, 0x77, 0xee, 0xc1, 0x9f, 0x23, 0x46,
+    0x8c, 0x05, 0x0a, 0x14, 0x28, 0x50, 0xa0, 0x5d, 0xba, 0x69, 0xd2, 0xb9, 0x6f, 0xde, 0xa1, 0x5f,
+    0xbe, 0x61, 0xc2, 0x99, 0x2f, 0x5e, 0xbc, 0x65, 0xca, 0x89, 0x0f, 0x1e, 0x3c, 0x78, 0xf0, 0xfd,
+    0xe7, 0xd3, 0xbb, 0x6b, 0xd6, 0xb1, 0x7f, 0xfe, 0xe1, 0xdf, 0xa3, 0x5b, 0xb6, 0x71, 0xe2, 0xd9,
+    0xaf, 0x43, 0x86, 0x11, 0x22, 0x44, 0x88, 0x0d, 0x1a, 0x34, 0x68, 0xd0, 0xbd, 0x67, 0xce, 0x81,
+    0x1f, 0x3e, 0x7c, 0xf8, 0xed, 0xc7, 0x93, 0x3b, 0x76, 0xec, 0xc5, 0x97, 0x33, 0x66, 0xcc, 0x85,
+    0x17, 0x2e, 0x5c, 0xb8, 0x6d, 0xda, 0xa9, 0x4f, 0x9e, 0x21, 0x42, 0x84, 0x15, 0x2a, 0x54, 0xa8,
+    0x4d, 0x9a, 0x29, 0x52, 0xa4, 0x55, 0xaa, 0x49, 0x92, 0x39, 0x72, 0xe4, 0xd5, 0xb7, 0x73, 0xe6,
+    0xd1, 0xbf, 0x63, 0xc6, 0x91, 0x3f, 0x7e, 0xfc, 0xe5, 0xd7, 0xb3, 0x7b, 0xf6, 0xf1, 0xff, 0xe3,
+    0xdb, 0xab, 0x4b, 0x96, 0x31, 0x62, 0xc4, 0x95, 0x37, 0x6e, 0xdc, 0xa5, 0x57, 0xae, 0x41, 0x82,
+    0x19, 0x32, 0x64, 0xc8, 0x8d, 0x07, 0x0e, 0x1c, 0x38, 0x70, 0xe0, 0xdd, 0xa7, 0x53, 0xa6, 0x51,
+    0xa2, 0x59, 0xb2, 0x79, 0xf2, 0xf9, 0xef, 0xc3, 0x9b, 0x2b, 0x56, 0xac, 0x45, 0x8a, 0x09, 0x12,
+    0x24, 0x48, 0x90, 0x3d, 0x7a, 0xf4, 0xf5, 0xf7, 0xf3, 0xfb, 0xeb, 0xcb, 0x8b, 0x0b, 0x16, 0x2c,
+    0x58, 0xb0, 0x7d, 0xfa, 0xe9, 0xcf, 0x83, 0x1b, 0x36, 0x6c, 0xd8, 0xad, 0x47, 0x8e, 0x01, 0x02,
+};
+
+// The discrete logarithm (base 0x02) of each non-zero element; GF_LOG[0] is undefined
+static const uint8_t GF_LOG[256] = {
+    0x00, 0x00, 0x01, 0x19, 0x02, 0x32, 0x1a, 0xc6, 0x03, 0xdf, 0x33, 0xee, 0x1b, 0x68, 0xc7, 0x4b,
+    0x04, 0x64, 0xe0, 0x0e, 0x34, 0x8d, 0xef, 0x81, 0x1c, 0xc1, 0x69, 0xf8, 0xc8, 0x08, 0x4c, 0x71,
+    0x05, 0x8a, 0x65, 0x2f, 0xe1, 0x24, 0x0f, 0x21, 0x35, 0x93, 0x8e, 0xda, 0xf0, 0x12, 0x82, 0x45,
+    0x1d, 0xb5, 0xc2, 0x7d, 0x6a, 0x27, 0xf9, 0xb9, 0xc9, 0x9a, 0x09, 0x78, 0x4d, 0xe4, 0x72, 0xa6,
+    0x06, 0xbf, 0x8b, 0x62, 0x66, 0xdd, 0x30, 0xfd, 0xe2, 0x98, 0x25, 0xb3, 0x10, 0x91, 0x22, 0x88,
+    0x36, 0xd0, 0x94, 0xce, 0x8f, 0x96, 0xdb, 0xbd, 0xf1, 0xd2, 0x13, 0x5c, 0x83, 0x38, 0x46, 0x40,
+    0x1e, 0x42, 0xb6, 0xa3, 0xc3, 0x48, 0x7e, 0x6e, 0x6b, 0x3a, 0x28, 0x54, 0xfa, 0x85, 0xba, 0x3d,
+    0xca, 0x5e, 0x9b, 0x9f, 0x0a, 0x15, 0x79, 0x2b, 0x4e, 0xd4, 0xe5, 0xac, 0x73, 0xf3, 0xa7, 0x57,
+    0x07, 0x70, 0xc0, 0xf7, 0x8c, 0x80, 0x63, 0x0d, 0x67, 0x4a, 0xde, 0xed, 0x31, 0xc5, 0xfe, 0x18,
+    0xe3, 0xa5, 0x99, 0x77, 0x26, 0xb8, 0xb4, 0x7c, 0x11, 0x44, 0x92, 0xd9, 0x23, 0x20, 0x89, 0x2e,
+    0x37, 0x3f, 0xd1, 0x5b, 0x95, 0xbc, 0xcf, 0xcd, 0x90, 0x87, 0x97, 0xb2, 0xdc, 0xfc, 0xbe, 0x61,
+    0xf2, 0x56, 0xd3, 0xab, 0x14, 0x2a, 0x5d, 0x9e, 0x84, 0x3c, 0x39, 0x53, 0x47, 0x6d, 0x41, 0xa2,
+    0x1f, 0x2d, 0x43, 0xd8, 0xb7, 0x7b, 0xa4, 0x76, 0xc4, 0x17, 0x49, 0xec, 0x7f, 0x0c, 0x6f, 0xf6,
+    0x6c, 0xa1, 0x3b, 0x52, 0x29, 0x9d, 0x55, 0xaa, 0xfb, 0x60, 0x86, 0xb1, 0xbb, 0xcc, 0x3e, 0x5a,
+    0xcb, 0x59, 0x5f, 0xb0, 0x9c, 0xa9, 0xa0, 0x51, 0x0b, 0xf5, 0x16, 0xeb, 0x7a, 0x75, 0x2c, 0xd7,
+    0x4f, 0xae, 0xd5, 0xe9, 0xe6, 0xe7, 0xad, 0xe8, 0x74, 0xd6, 0xf4, 0xea, 0xa8, 0x50, 0x58, 0xaf,
+};
+
+// The generator polynomials (as logarithms, see rs_init) for each block ECC length
+// used by any version and error correction level, so they need not be rebuilt
+static const uint8_t RS_GENERATORS[246] = {
+    // Degree 7
+     87, 229, 146, 149, 238, 102,  21,
+    // Degree 10
+    251,  67,  46,  61, 118,  70,  64,  94,  32,  45,
+    // Degree 13
+     74, 152, 176, 100,  86, 100, 106, 104, 130, 218, 206, 140,  78,
+    // Degree 15
+      8, 183,  61,  91, 202,  37,  51,  58,  58, 237, 140, 124,   5,  99, 105,
+    // Degree 16
+    120, 104, 107, 109, 102, 161,  76,   3,  91, 191, 147, 169, 182, 194, 225, 120,
+    // Degree 17
+     43, 139, 206,  78,  43, 239, 123, 206, 214, 147,  24,  99, 150,  39, 243, 163, 136,
+    // Degree 18
+    215, 234, 158,  94, 184,  97, 118, 170,  79, 187, 152, 148, 252, 179,   5,  98,  96, 153,
+    // Degree 20
+     17,  60,  79,  50,  61, 163,  26, 187, 202, 180, 221, 225,  83, 239, 156, 164, 212, 212, 188, 190,
+    // Degree 22
+    210, 171, 247, 242,  93, 230,  14, 109, 221,  53, 200,  74,   8, 172,  98,  80, 219, 134, 160, 105, 165, 231,
+    // Degree 24
+    229, 121, 135,  48, 211, 117, 251, 126, 159, 180, 169, 152, 192, 226, 228, 218, 111,   0, 117, 232,  87,  96, 227,  21,
+    // Degree 26
+    173, 125, 158,   2, 103, 182, 118,  17, 145, 201, 111,  28, 165,  53, 161,  21, 245, 142,  13, 102,  48, 227, 153, 145, 218,  70,
+    // Degree 28
+    168, 223, 200, 104, 224, 234, 108, 180, 110, 190, 195, 147, 205,  27, 232, 201,  21,  43, 245,  87,  42, 195, 212, 119, 242,  37,   9, 123,
+    // Degree 30
+     41, 173, 145, 152, 216,  31, 179, 182,  50,  48, 110,  86, 239,  96, 222, 125,  42, 173, 226, 193, 224, 130, 156,  37, 251, 216, 238,  40, 192, 180,
+};
+
+// Offset into RS_GENERATORS for each degree; 0xFF if the degree is not tabulated
+static const uint8_t RS_GENERATOR_OFFSETS[31] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0, 0xFF, 0xFF, 7, 0xFF, 0xFF, 17, 0xFF, 30, 45, 61, 78, 0xFF, 96, 0xFF, 116, 0xFF, 138, 0xFF, 162, 0xFF, 188, 0xFF, 216
+};
+
+#else
+
+static uint8_t rs_multiply(uint8_t x, uint8_t y) {
+    // Russian peasant multiplication
+    // See: https://en.wikipedia.org/wiki/Ancient_Egyptian_multiplication
+    uint16_t z = 0;
+    for (int8_t i = 7; i >= 0; i--) {
         z = (z << 1) ^ ((z >> 7) * 0x11D);
         z ^= ((y >> i) & 1) * x;
     }
     return z;
 }
 
+#endif
+
+// With RS_LOOKUP_TABLES, the coefficients are returned as their logarithms, which is
+// the form rs_getRemainder consumes. (None of the generator polynomials used by QR
+// codes have a zero coefficient, so every coefficient has a logarithm.)
 static void rs_init(uint8_t degree, uint8_t *coeff) {
     memset(coeff, 0, degree);
     coeff[degree - 1] = 1;
@@ -590,6 +1430,23 @@ static void rs_init(uint8_t degree, uint8_t *coeff) {
     // Compute the product polynomial (x - r^0) * (x - r^1) * (x - r^2) * ... * (x - r^{degree-1}),
     // drop the highest term, and store the rest of the coefficients in order of descending powers.
     // Note that r = 0x02, which is a generator element of this field GF(2^8/0x11D).
+#if RS_LOOKUP_TABLES
+    for (uint8_t i = 0; i < degree; i++) {
+        // Multiply the current product by (x - r^i); r^i has the logarithm i
+        for (uint8_t j = 0; j < degree; j++) {
+            if (coeff[j] != 0) {
+                coeff[j] = GF_EXP[GF_LOG[coeff[j]] + i];
+            }
+            if (j + 1 < degree) {
+                coeff[j] ^= coeff[j + 1];
+            }
+        }
+    }
+    
+    for (uint8_t j = 0; j < degree; j++) {
+        coeff[j] = GF_LOG[coeff[j]];
+    }
+#else
     uint16_t root = 1;
     for (uint8_t i = 0; i < degree; i++) {
         // Multiply the current product by (x - r^i)
@@ -601,9 +1458,28 @@ static void rs_init(uint8_t degree, uint8_t *coeff) {
         }
         root = (root << 1) ^ ((root >> 7) * 0x11D);  // Multiply by 0x02 mod GF(2^8/0x11D)
     }
+#endif
+}
+
+static uint32_t generatorHits = 0;
+static uint32_t generatorMisses = 0;
+
+// Returns the generator polynomial of the given degree (in the form produced by rs_init),
+// from the table if it is available, otherwise built into buffer.
+static const uint8_t* rs_getGenerator(uint8_t degree, uint8_t *buffer) {
+#if RS_LOOKUP_TABLES
+    if (degree < sizeof(RS_GENERATOR_OFFSETS) && RS_GENERATOR_OFFSETS[degree] != 0xFF) {
+        ATOMIC_INCREMENT(generatorHits);
+        return &RS_GENERATORS[RS_GENERATOR_OFFSETS[degree]];
+    }
+#endif
+    
+    ATOMIC_INCREMENT(generatorMisses);
+    rs_init(degree, buffer);
+    return buffer;
 }
 
-static void rs_getRemainder(uint8_t degree, uint8_t *coeff, uint8_t *data, uint8_t length, uint8_t *result, uint8_t stride) {
+static void rs_getRemainder(uint8_t degree, const uint8_t *coeff, uint8_t *data, uint8_t length, uint8_t *result, uint8_t stride) {
     // Compute the remainder by performing polynomial division
     
     //for (uint8_t i = 0; i < degree; i++) { result[] = 0; }
@@ -616,9 +1492,19 @@ static void rs_getRemainder(uint8_t degree, uint8_t *coeff, uint8_t *data, uint8
         }
         result[(degree - 1) * stride] = 0;
         
+#if RS_LOOKUP_TABLES
+        if (factor == 0) { continue; }
+        
+        // Multiplying by factor is adding its logarithm to each (logarithmic) coefficient
+        uint8_t factorLog = GF_LOG[factor];
+        for (uint8_t j = 0; j < degree; j++) {
+            result[j * stride] ^= GF_EXP[coeff[j] + factorLog];
+        }
+#else
         for (uint8_t j = 0; j < degree; j++) {
             result[j * stride] ^= rs_multiply(coeff[j], factor);
         }
+#endif
     }
 }
 
@@ -626,67 +1512,120 @@ static void rs_getRemainder(uint8_t degree, uint8_t *coeff, uint8_t *data, uint8
 
 #pragma mark - QrCode
 
-static int8_t encodeDataCodewords(BitBucket *dataCodewords, const uint8_t *text, uint16_t length, uint8_t version) {
-    int8_t mode = MODE_BYTE;
-    
-    if (isNumeric((char*)text, length)) {
-        mode = MODE_NUMERIC;
-        bb_appendBits(dataCodewords, 1 << MODE_NUMERIC, 4);
-        bb_appendBits(dataCodewords, length, getModeBits(version, MODE_NUMERIC));
-
-        uint16_t accumData = 0;
-        uint8_t accumCount = 0;
-        for (uint16_t i = 0; i < length; i++) {
-            accumData = accumData * 10 + ((char)(text[i]) - '0');
-            accumCount++;
-            if (accumCount == 3) {
-                bb_appendBits(dataCodewords, accumData, 10);
-                accumData = 0;
-                accumCount = 0;
-            }
-        }
-        
-        // 1 or 2 digits remaining
-        if (accumCount > 0) {
-            bb_appendBits(dataCodewords, accumData, accumCount * 3 + 1);
-        }
+// Appends a segment of the given mode, which every character must be valid in, of the next
+// length bytes at the cursor. They are read a run (within one part) at a time, with any partial
+// group of characters carried over to the next run.
+static void appendSegment(BitBucket *dataCodewords, uint8_t mode, DataCursor *cursor, uint16_t length, uint8_t version) {
+    bb_appendBits(dataCodewords, 1 << mode, 4);
+    bb_appendBits(dataCodewords, (mode == MODE_KANJI) ? length / 2: length, getModeBits(version, mode));
+    
+    uint16_t accumData = 0;
+    uint8_t accumCount = 0;
+    while (length > 0) {
+        const uint8_t *text;
+        uint16_t count = cursor_read(cursor, &text, length);
+        length -= count;
         
-    } else if (isAlphanumeric((char*)text, length)) {
-        mode = MODE_ALPHANUMERIC;
-        bb_appendBits(dataCodewords, 1 << MODE_ALPHANUMERIC, 4);
-        bb_appendBits(dataCodewords, length, getModeBits(version, MODE_ALPHANUMERIC));
-
-        uint16_t accumData = 0;
-        uint8_t accumCount = 0;
-        for (uint16_t i = 0; i  < length; i++) {
-            accumData = accumData * 45 + getAlphanumeric((char)(text[i]));
-            accumCount++;
-            if (accumCount == 2) {
-                bb_appendBits(dataCodewords, accumData, 11);
-                accumData = 0;
-                accumCount = 0;
+        if (mode == MODE_KANJI) {
+            for (uint16_t i = 0; i < count; i++) {
+                accumData = (accumData << 8) | text[i];
+                accumCount++;
+                if (accumCount == 2) {
+                    bb_appendBits(dataCodewords, getKanji(accumData >> 8, accumData & 0xFF), 13);
+                    accumData = 0;
+                    accumCount = 0;
+                }
             }
+            
+        } else if (mode == MODE_NUMERIC) {
+            for (uint16_t i = 0; i < count; i++) {
+                accumData = accumData * 10 + ((char)(text[i]) - '0');
+                accumCount++;
+                if (accumCount == 3) {
+                    bb_appendBits(dataCodewords, accumData, 10);
+                    accumData = 0;
+                    accumCount = 0;
+                }
+            }
+            
+        } else if (mode == MODE_ALPHANUMERIC) {
+            for (uint16_t i = 0; i  < count; i++) {
+                accumData = accumData * 45 + getAlphanumeric((char)(text[i]));
+                accumCount++;
+                if (accumCount == 2) {
+                    bb_appendBits(dataCodewords, accumData, 11);
+                    accumData = 0;
+                    accumCount = 0;
+                }
+            }
+            
+        } else {
+            bb_appendBytes(dataCodewords, text, count);
         }
-        
-        // 1 character remaining
-        if (accumCount > 0) {
-            bb_appendBits(dataCodewords, accumData, 6);
-        }
-        
+    }
+    
+    // 1 or 2 digits, or 1 alphanumeric character, remaining
+    if (accumCount > 0 && mode == MODE_NUMERIC) {
+        bb_appendBits(dataCodewords, accumData, accumCount * 3 + 1);
+    } else if (accumCount > 0 && mode == MODE_ALPHANUMERIC) {
+        bb_appendBits(dataCodewords, accumData, 6);
+    }
+}
+
+// The position of a symbol in a Structured Append sequence, and the parity of all their data
+typedef struct Sequence {
+    uint8_t index;
+    uint8_t total;
+    uint8_t parity;
+} Sequence;
+
+static const uint8_t SEQUENCE_HEADER_BITS = 4 + 4 + 4 + 8;
+
+// Appends a Structured Append header
+static void appendSequence(BitBucket *dataCodewords, const Sequence *sequence) {
+    bb_appendBits(dataCodewords, 0x03, 4);
+    bb_appendBits(dataCodewords, sequence->index, 4);
+    bb_appendBits(dataCodewords, sequence->total - 1, 4);
+    bb_appendBits(dataCodewords, sequence->parity, 8);
+}
+
+// Appends an ECI header for the assignment number (if non-zero)
+static void appendEci(BitBucket *dataCodewords, uint32_t eci) {
+    if (eci == 0) { return; }
+    
+    bb_appendBits(dataCodewords, 0x07, 4);
+    if (eci < (1 << 7)) {
+        bb_appendBits(dataCodewords, eci, 8);
+    } else if (eci < (1 << 14)) {
+        bb_appendBits(dataCodewords, (0x02 << 14) | eci, 16);
     } else {
-        bb_appendBits(dataCodewords, 1 << MODE_BYTE, 4);
-        bb_appendBits(dataCodewords, length, getModeBits(version, MODE_BYTE));
-        for (uint16_t i = 0; i < length; i++) {
-            bb_appendBits(dataCodewords, (char)(text[i]), 8);
-        }
+        bb_appendBits(dataCodewords, (0x06 << 21) | eci, 24);
+    }
+}
+
+// Appends the data as a single segment in the narrowest mode that fits all of it or, if
+// charModes is non-NULL, as a segment for each run of characters in the same mode. Returns
+// the mode of the (first) segment.
+static uint8_t encodeDataCodewords(BitBucket *dataCodewords, const DataParts *data, uint8_t version, bool kanji, const uint8_t *charModes) {
+    uint16_t length = data->length;
+    DataCursor cursor;
+    cursor_init(&cursor, data);
+    
+    if (!charModes || length == 0) {
+        uint8_t mode = getDataMode(data, kanji);
+        appendSegment(dataCodewords, mode, &cursor, length, version);
+        return mode;
     }
     
-    //bb_setBits(dataCodewords, length, 4, getModeBits(version, mode));
+    for (uint16_t start = 0, end; start < length; start = end) {
+        for (end = start + 1; end < length && charModes[end] == charModes[start]; end++) { }
+        appendSegment(dataCodewords, charModes[start], &cursor, end - start, version);
+    }
     
-    return mode;
+    return charModes[0];
 }
 
-static void performErrorCorrection(uint8_t version, uint8_t ecc, BitBucket *data) {
+static void performErrorCorrection(uint8_t version, uint8_t ecc, BitBucket *data, Arena *arena) {
     
     // See: http://www.thonky.com/qr-code-tutorial/structure-final-message
     
@@ -706,11 +1645,12 @@ static void performErrorCorrection(uint8_t version, uint8_t ecc, BitBucket *data
     
     uint8_t shortDataBlockLen = shortBlockLen - blockEccLen;
     
-    uint8_t result[data->capacityBytes];
-    memset(result, 0, sizeof(result));
+    SCRATCH_MARK(arena);
+    SCRATCH_BUFFER(uint8_t, result, data->capacityBytes, arena);
+    memset(result, 0, data->capacityBytes);
     
-    uint8_t coeff[blockEccLen];
-    rs_init(blockEccLen, coeff);
+    SCRATCH_BUFFER(uint8_t, coeffBuffer, blockEccLen, arena);
+    const uint8_t *coeff = rs_getGenerator(blockEccLen, coeffBuffer);
     
     uint16_t offset = 0;
     uint8_t *dataBytes = data->data;
@@ -758,6 +1698,8 @@ static void performErrorCorrection(uint8_t version, uint8_t ecc, BitBucket *data
     
     memcpy(data->data, result, data->capacityBytes);
     data->bitOffsetOrWidth = moduleCount;
+    
+    SCRATCH_RELEASE(arena);
 }
 
 // We store the Format bits tightly packed into a single byte (each of the 4 modes is 2 bits)
@@ -765,100 +1707,1995 @@ static void performErrorCorrection(uint8_t version, uint8_t ecc, BitBucket *data
 static const uint8_t ECC_FORMAT_BITS = (0x02 << 6) | (0x03 << 4) | (0x00 << 2) | (0x01 << 0);
 
 
-#pragma mark - Public QRCode functions
+#pragma mark - Mask Selection
 
-uint16_t qrcode_getBufferSize(uint8_t version) {
-    return bb_getGridSizeBytes(4 * version + 17);
+// Returns the masks to try for the options, as a bit per mask
+static uint8_t getMaskCandidates(const QRCodeOptions *options) {
+    if (!options || options->maskPolicy == MASK_BEST) { return 0xFF; }
+    if (options->maskPolicy == MASK_FIXED) { return 1 << options->fixedMask; }
+    
+    // The masks that most often score best; on their own, the penalty of the mask chosen
+    // is only about 1.5% higher on average
+    return (1 << 0) | (1 << 2) | (1 << 4) | (1 << 6);
 }
 
-// @TODO: Return error if data is too big.
-int8_t qrcode_initBytes(QRCode *qrcode, uint8_t *modules, uint8_t version, uint8_t ecc, uint8_t *data, uint16_t length) {
-    uint8_t size = version * 4 + 17;
-    qrcode->version = version;
-    qrcode->size = size;
-    qrcode->ecc = ecc;
-    qrcode->modules = modules;
+// Tries each candidate mask in place, then draws the format bits for and applies the one
+// with the lowest penalty (the lowest index on ties), returning it; a single candidate is
+// applied without scoring. If maskGrids is non-NULL, it holds the grids built by
+// buildMaskGrid for masks 0 through 7, consecutively.
+static uint8_t applyBestMask(BitBucket *modulesGrid, BitBucket *isFunctionGrid, uint8_t eccFormatBits, const uint8_t *maskGrids, uint8_t maskCandidates, Arena *arena) {
+    SCRATCH_MARK(arena);
+    
+#if FAST_MASKING
+    uint16_t gridBytes = modulesGrid->capacityBytes;
+    
+    BitBucket maskGrid;
+    SCRATCH_BUFFER(uint8_t, maskGridBytes, maskGrids ? 1: gridBytes, arena);
+    maskGrid.bitOffsetOrWidth = modulesGrid->bitOffsetOrWidth;
+    maskGrid.capacityBytes = gridBytes;
+    maskGrid.data = maskGridBytes;
+#else
+    (void)maskGrids;
+#endif
     
-    uint8_t eccFormatBits = (ECC_FORMAT_BITS >> (2 * ecc)) & 0x03;
+    uint8_t mask = 0;
+    uint32_t minPenalty = UINT32_MAX;
+    for (uint8_t i = 0; i < 8; i++) {
+        if ((maskCandidates & (1 << i)) == 0) { continue; }
+        if ((maskCandidates & (maskCandidates - 1)) == 0) {
+            mask = i;
+            break;
+        }
+        
+        drawFormatBits(modulesGrid, NULL, eccFormatBits, i);
+#if FAST_MASKING
+        if (maskGrids) {
+            maskGrid.data = (uint8_t*)&maskGrids[i * gridBytes];  // Only read
+        } else {
+            buildMaskGrid(&maskGrid, isFunctionGrid, i);
+        }
+        applyMask(modulesGrid, &maskGrid);
+#else
+        applyMask(modulesGrid, isFunctionGrid, i);
+#endif
+        uint32_t penalty = getPenaltyScore(modulesGrid, minPenalty, arena);
+        if (penalty < minPenalty) {
+            mask = i;
+            minPenalty = penalty;
+        }
+#if FAST_MASKING
+        applyMask(modulesGrid, &maskGrid);  // Undoes the mask due to XOR
+#else
+        applyMask(modulesGrid, isFunctionGrid, i);  // Undoes the mask due to XOR
+#endif
+    }
     
-#if LOCK_VERSION == 0
-    uint16_t moduleCount = NUM_RAW_DATA_MODULES[version - 1];
-    uint16_t dataCapacity = moduleCount / 8 - NUM_ERROR_CORRECTION_CODEWORDS[eccFormatBits][version - 1];
+    // Overwrite old format bits
+    drawFormatBits(modulesGrid, NULL, eccFormatBits, mask);
+    
+    // Apply the final choice of mask
+#if FAST_MASKING
+    if (maskGrids) {
+        maskGrid.data = (uint8_t*)&maskGrids[mask * gridBytes];  // Only read
+    } else {
+        buildMaskGrid(&maskGrid, isFunctionGrid, mask);
+    }
+    applyMask(modulesGrid, &maskGrid);
 #else
-    version = LOCK_VERSION;
-    uint16_t moduleCount = NUM_RAW_DATA_MODULES;
-    uint16_t dataCapacity = moduleCount / 8 - NUM_ERROR_CORRECTION_CODEWORDS[eccFormatBits];
+    applyMask(modulesGrid, isFunctionGrid, mask);
 #endif
     
-    struct BitBucket codewords;
-    uint8_t codewordBytes[bb_getBufferSizeBytes(moduleCount)];
-    bb_initBuffer(&codewords, codewordBytes, (int32_t)sizeof(codewordBytes));
+    SCRATCH_RELEASE(arena);
     
-    // Place the data code words into the buffer
-    int8_t mode = encodeDataCodewords(&codewords, data, length, version);
+    return mask;
+}
+
+typedef struct MaskCandidates {
+    BitBucket *modules;
+    BitBucket *isFunction;
+    const uint8_t *maskGrids;
+    uint8_t eccFormatBits;
+    uint8_t *candidateBytes;
+    uint8_t *penaltyScratch;       // NULL, or getPenaltyScratchSize bytes per candidate
+    uint32_t penaltyScratchSize;
+    uint8_t masks[8];
+    uint32_t penalties[8];
+} MaskCandidates;
+
+// Renders and scores a single mask candidate into its own grid; safe to run concurrently
+// with the other candidates, as the shared grids are only read
+static void evaluateMaskCandidate(void *arg, uint8_t index) {
+    MaskCandidates *candidates = (MaskCandidates*)arg;
+    uint16_t gridBytes = candidates->modules->capacityBytes;
+    uint8_t mask = candidates->masks[index];
+    
+    BitBucket candidate;
+    candidate.bitOffsetOrWidth = candidates->modules->bitOffsetOrWidth;
+    candidate.capacityBytes = gridBytes;
+    candidate.data = &candidates->candidateBytes[index * gridBytes];
+    
+#if FAST_MASKING
+    if (candidates->maskGrids) {
+        memcpy(candidate.data, &candidates->maskGrids[mask * gridBytes], gridBytes);
+    } else {
+        buildMaskGrid(&candidate, candidates->isFunction, mask);
+    }
+    applyMask(&candidate, candidates->modules);
+#else
+    memcpy(candidate.data, candidates->modules->data, gridBytes);
+    applyMask(&candidate, candidates->isFunction, mask);
+#endif
+    drawFormatBits(&candidate, NULL, candidates->eccFormatBits, mask);
+    
+    // Each candidate scores in its own slice of the penalty scratch, if there is any
+    Arena arena;
+    Arena *penaltyArena = NULL;
+    if (candidates->penaltyScratch) {
+        arena.data = &candidates->penaltyScratch[index * candidates->penaltyScratchSize];
+        arena.used = 0;
+        arena.capacity = candidates->penaltyScratchSize;
+        penaltyArena = &arena;
+    }
     
-    if (mode < 0) { return -1; }
-    qrcode->mode = mode;
+    // The candidates may run in any order, so each is scored in full
+    candidates->penalties[index] = getPenaltyScore(&candidate, UINT32_MAX, penaltyArena);
+}
+
+// Same as applyBestMask (for several candidates), but each candidate is rendered into its
+// own scratch grid, and they are scored through the caller's executor
+static uint8_t applyBestMaskConcurrently(BitBucket *modulesGrid, BitBucket *isFunctionGrid, uint8_t eccFormatBits, const uint8_t *maskGrids, uint8_t maskCandidates, const QRCodeOptions *options, Arena *arena) {
+    SCRATCH_MARK(arena);
+    SCRATCH_BUFFER(uint8_t, candidateBytes, 8 * modulesGrid->capacityBytes, arena);
+    
+    // Each candidate needs its own penalty scratch, as they may be scored concurrently
+    uint32_t penaltyScratchSize = getPenaltyScratchSize(modulesGrid->bitOffsetOrWidth);
+    
+    MaskCandidates candidates;
+    candidates.penaltyScratch = (arena && penaltyScratchSize) ? arena_alloc(arena, 8 * penaltyScratchSize): NULL;
+    candidates.penaltyScratchSize = penaltyScratchSize;
+    candidates.modules = modulesGrid;
+    candidates.isFunction = isFunctionGrid;
+    candidates.maskGrids = maskGrids;
+    candidates.eccFormatBits = eccFormatBits;
+    candidates.candidateBytes = candidateBytes;
+    
+    uint8_t count = 0;
+    for (uint8_t i = 0; i < 8; i++) {
+        if (maskCandidates & (1 << i)) { candidates.masks[count++] = i; }
+    }
     
-    // Add terminator and pad up to a byte if applicable
-    uint32_t padding = (dataCapacity * 8) - codewords.bitOffsetOrWidth;
-    if (padding > 4) { padding = 4; }
-    bb_appendBits(&codewords, 0, padding);
-    bb_appendBits(&codewords, 0, (8 - codewords.bitOffsetOrWidth % 8) % 8);
+    options->executor(options->executorContext, evaluateMaskCandidate, &candidates, count);
+    
+    uint8_t best = 0;
+    for (uint8_t i = 1; i < count; i++) {
+        if (candidates.penalties[i] < candidates.penalties[best]) { best = i; }
+    }
+    
+    memcpy(modulesGrid->data, &candidateBytes[best * modulesGrid->capacityBytes], modulesGrid->capacityBytes);
+    
+    SCRATCH_RELEASE(arena);
+    
+    return candidates.masks[best];
+}
 
-    // Pad with alternate bytes until data capacity is reached
-    for (uint8_t padByte = 0xEC; codewords.bitOffsetOrWidth < (dataCapacity * 8); padByte ^= 0xEC ^ 0x11) {
-        bb_appendBits(&codewords, padByte, 8);
+#if USE_PTHREADS
+
+#if THREAD_POOL_SIZE >= 2
+
+// The threads of qrcode_threadExecutor, started on its first call and then kept waiting
+// for the next job. A job is one call's tasks, which every thread (the caller included)
+// takes the next index of until none are left.
+typedef struct ThreadPool {
+    pthread_mutex_t lock;
+    pthread_cond_t jobReady;     // Signalled when a job is posted
+    pthread_cond_t jobDone;      // Signalled when the last task of the job finishes
+    void (*task)(void *arg, uint8_t index);
+    void *arg;
+    uint8_t next;
+    uint8_t count;
+    uint8_t finished;
+    bool busy;                   // A job is posted and not yet collected by its caller
+} ThreadPool;
+
+static ThreadPool threadPool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0, 0, 0, false };
+static pthread_once_t threadPoolOnce = PTHREAD_ONCE_INIT;
+
+// Runs tasks of the current job until none are left to take; called with the lock held,
+// and returns with it held
+static void runThreadPoolTasks(ThreadPool *pool) {
+    while (pool->busy && pool->next < pool->count) {
+        uint8_t index = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        
+        pool->task(pool->arg, index);
+        
+        pthread_mutex_lock(&pool->lock);
+        if (++pool->finished == pool->count) { pthread_cond_signal(&pool->jobDone); }
     }
+}
 
-    BitBucket modulesGrid;
-    bb_initGrid(&modulesGrid, modules, size);
+static void* runThreadPool(void *arg) {
+    ThreadPool *pool = (ThreadPool*)arg;
     
-    BitBucket isFunctionGrid;
-    uint8_t isFunctionGridBytes[bb_getGridSizeBytes(size)];
-    bb_initGrid(&isFunctionGrid, isFunctionGridBytes, size);
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        while (!pool->busy || pool->next >= pool->count) { pthread_cond_wait(&pool->jobReady, &pool->lock); }
+        runThreadPoolTasks(pool);
+    }
     
-    // Draw function patterns, draw all codewords, do masking
-    drawFunctionPatterns(&modulesGrid, &isFunctionGrid, version, eccFormatBits);
-    performErrorCorrection(version, eccFormatBits, &codewords);
-    drawCodewords(&modulesGrid, &isFunctionGrid, &codewords);
+    return NULL;
+}
+
+// If a thread fails to start, the others (and the callers) simply take its share
+static void startThreadPool(void) {
+    for (uint8_t i = 0; i < THREAD_POOL_SIZE - 1; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, runThreadPool, &threadPool) != 0) { break; }
+        pthread_detach(thread);
+    }
+}
+
+void qrcode_threadExecutor(void *context, void (*task)(void *arg, uint8_t index), void *arg, uint8_t count) {
+    (void)context;
     
-    // Find the best (lowest penalty) mask
-    uint8_t mask = 0;
-    int32_t minPenalty = INT32_MAX;
-    for (uint8_t i = 0; i < 8; i++) {
-        drawFormatBits(&modulesGrid, &isFunctionGrid, eccFormatBits, i);
-        applyMask(&modulesGrid, &isFunctionGrid, i);
-        int penalty = getPenaltyScore(&modulesGrid);
-        if (penalty < minPenalty) {
-            mask = i;
-            minPenalty = penalty;
+    pthread_once(&threadPoolOnce, startThreadPool);
+    
+    // The pool runs one job at a time; a call made while it is busy (from another thread,
+    // or from within a task) runs its tasks inline rather than waiting
+    ThreadPool *pool = &threadPool;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->busy || count < 2) {
+        pthread_mutex_unlock(&pool->lock);
+        for (uint8_t i = 0; i < count; i++) { task(arg, i); }
+        return;
+    }
+    
+    pool->task = task;
+    pool->arg = arg;
+    pool->next = 0;
+    pool->count = count;
+    pool->finished = 0;
+    pool->busy = true;
+    pthread_cond_broadcast(&pool->jobReady);
+    
+    runThreadPoolTasks(pool);
+    while (pool->finished < pool->count) { pthread_cond_wait(&pool->jobDone, &pool->lock); }
+    
+    pool->busy = false;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+#else
+
+void qrcode_threadExecutor(void *context, void (*task)(void *arg, uint8_t index), void *arg, uint8_t count) {
+    (void)context;
+    
+    for (uint8_t i = 0; i < count; i++) { task(arg, i); }
+}
+
+#endif
+
+#endif
+
+
+#pragma mark - Symbol Encoding
+
+// The parts of a symbol which depend only on its version, so they can be shared by every
+// symbol of that version. The function modules are complete once built, so all fields
+// are only ever read while encoding.
+typedef struct VersionTemplate {
+    const uint8_t *modules;      // The function patterns (with placeholder format bits)
+    const uint8_t *isFunction;
+    const uint8_t *maskGrids;    // NULL, or the grids of buildMaskGrid for masks 0 through 7
+    const uint16_t *placement;   // NULL, or the offsets of buildPlacement
+} VersionTemplate;
+
+#if (LOCK_VERSION == 0 && TEMPLATE_CACHE) || USE_PTHREADS
+
+// Records the grid offset of each data module, in the order drawCodewords visits them
+static void buildPlacement(BitBucket *isFunction, uint16_t *placement) {
+    uint8_t size = isFunction->bitOffsetOrWidth;
+    
+    for (int16_t right = size - 1; right >= 1; right -= 2) {
+        if (right == 6) { right = 5; }
+        
+        for (uint8_t vert = 0; vert < size; vert++) {
+            for (int j = 0; j < 2; j++) {
+                uint8_t x = right - j;
+                bool upwards = ((right & 2) == 0) ^ (x < 6);
+                uint8_t y = upwards ? size - 1 - vert : vert;
+                if (!bb_getBit(isFunction, x, y)) { *placement++ = y * size + x; }
+            }
         }
-        applyMask(&modulesGrid, &isFunctionGrid, i);  // Undoes the mask due to XOR
     }
+}
+
+// Each buffer must hold bb_getGridSizeBytes(size) bytes (8 times that for maskGrids, which
+// may be NULL, and is ignored without FAST_MASKING). If non-NULL, placement must hold an
+// entry for each raw data module of the version.
+static void initVersionTemplate(VersionTemplate *versionTemplate, uint8_t version, uint8_t *modules, uint8_t *isFunction, uint8_t *maskGrids, uint16_t *placement) {
+    uint8_t size = version * 4 + 17;
     
-    qrcode->mask = mask;
+    BitBucket modulesGrid, isFunctionGrid;
+    bb_initGrid(&modulesGrid, modules, size);
+    bb_initGrid(&isFunctionGrid, isFunction, size);
+    drawFunctionPatterns(&modulesGrid, &isFunctionGrid, version, 0);
+    
+    versionTemplate->modules = modules;
+    versionTemplate->isFunction = isFunction;
+    versionTemplate->maskGrids = NULL;
+    versionTemplate->placement = placement;
+    
+    if (placement) { buildPlacement(&isFunctionGrid, placement); }
+    
+#if FAST_MASKING
+    if (maskGrids) {
+        BitBucket maskGrid;
+        maskGrid.bitOffsetOrWidth = size;
+        maskGrid.capacityBytes = modulesGrid.capacityBytes;
+        for (uint8_t i = 0; i < 8; i++) {
+            maskGrid.data = &maskGrids[i * maskGrid.capacityBytes];
+            buildMaskGrid(&maskGrid, &isFunctionGrid, i);
+        }
+        versionTemplate->maskGrids = maskGrids;
+    }
+#else
+    (void)maskGrids;
+#endif
+}
+
+#endif
+
+#if TEMPLATE_CACHE
+
+#if LOCK_VERSION == 0
+
+// The template of each version is built the first time it is needed, and then shared by
+// every later symbol (from any thread) for the life of the program
+static VersionTemplate *versionTemplates[40];
+
+// Stores versionTemplate into an empty slot, returning false if another thread already has
+static bool publishVersionTemplate(VersionTemplate **slot, VersionTemplate *versionTemplate) {
+#if defined(__GNUC__) && !defined(__AVR__)
+    VersionTemplate *expected = NULL;
+    return __atomic_compare_exchange_n(slot, &expected, versionTemplate, false, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE);
+#else
+    if (*slot) { return false; }
+    *slot = versionTemplate;
+    return true;
+#endif
+}
+
+// Returns the cached template for version, or NULL if it could not be allocated
+static const VersionTemplate* getVersionTemplate(uint8_t version) {
+    VersionTemplate *versionTemplate = ATOMIC_LOAD_ACQUIRE(versionTemplates[version - 1]);
+    if (versionTemplate) { return versionTemplate; }
     
-    // Overwrite old format bits
-    drawFormatBits(&modulesGrid, &isFunctionGrid, eccFormatBits, mask);
+    // The placement offsets, then the grids
+    uint16_t gridBytes = bb_getGridSizeBytes(version * 4 + 17);
+    uint16_t moduleCount = NUM_RAW_DATA_MODULES[version - 1];
+    versionTemplate = (VersionTemplate*)malloc(sizeof(VersionTemplate) + moduleCount * sizeof(uint16_t) + (FAST_MASKING ? 10: 2) * gridBytes);
+    if (!versionTemplate) { return NULL; }
     
-    // Apply the final choice of mask
-    applyMask(&modulesGrid, &isFunctionGrid, mask);
+    uint16_t *placement = (uint16_t*)&versionTemplate[1];
+    uint8_t *data = (uint8_t*)&placement[moduleCount];
+    initVersionTemplate(versionTemplate, version, data, &data[gridBytes], FAST_MASKING ? &data[2 * gridBytes]: NULL, placement);
+    
+    // Another thread may have built the same template meanwhile; the first one wins
+    if (!publishVersionTemplate(&versionTemplates[version - 1], versionTemplate)) {
+        free(versionTemplate);
+        versionTemplate = ATOMIC_LOAD_ACQUIRE(versionTemplates[version - 1]);
+    }
+    
+    return versionTemplate;
+}
 
-    return 0;
+#elif LOCK_VERSION == 3
+
+// The output of initVersionTemplate for version 3
+
+static const uint8_t LOCKED_TEMPLATE_MODULES[106] = {
+    0xfe, 0x00, 0x03, 0xfc, 0x14, 0x00, 0x10, 0x6e, 0x80, 0x00, 0xbb, 0x74, 0x00, 0x05, 0xdb, 0xa8,
+    0x00, 0x2e, 0xc1, 0x00, 0x01, 0x07, 0xfa, 0xaa, 0xaf, 0xe0, 0x00, 0x00, 0x00, 0xaa, 0x00, 0x00,
+    0x90, 0x00, 0x00, 0x00, 0x00, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x20, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x20, 0x00, 0xf8, 0x00, 0x40, 0x04, 0x43,
+    0xf8, 0x00, 0x2a, 0x10, 0x40, 0x01, 0x10, 0xba, 0x80, 0x0f, 0x85, 0xd0, 0x00, 0x00, 0x2e, 0xa0,
+    0x00, 0x01, 0x04, 0x00, 0x00, 0x0f, 0xe8, 0x00, 0x00, 0x00,
+};
+
+static const uint8_t LOCKED_TEMPLATE_IS_FUNCTION[106] = {
+    0xff, 0x80, 0x07, 0xff, 0xfc, 0x00, 0x3f, 0xff, 0xe0, 0x01, 0xff, 0xff, 0x00, 0x0f, 0xff, 0xf8,
+    0x00, 0x7f, 0xff, 0xc0, 0x03, 0xff, 0xff, 0xff, 0xff, 0xff, 0xf0, 0x00, 0xff, 0xff, 0x80, 0x07,
+    0xf8, 0x10, 0x00, 0x00, 0x00, 0x80, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00, 0x20, 0x00, 0x00, 0x01,
+    0x00, 0x00, 0x00, 0x08, 0x00, 0x00, 0x00, 0x40, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0x10, 0x00,
+    0x00, 0x00, 0x80, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00, 0x20, 0x00, 0xf8, 0x7f, 0xc0, 0x07, 0xc3,
+    0xfe, 0x00, 0x3e, 0x1f, 0xf0, 0x01, 0xf0, 0xff, 0x80, 0x0f, 0x87, 0xfc, 0x00, 0x00, 0x3f, 0xe0,
+    0x00, 0x01, 0xff, 0x00, 0x00, 0x0f, 0xf8, 0x00, 0x00, 0x00,
+};
+
+#if FAST_MASKING
+static const uint8_t LOCKED_TEMPLATE_MASK_GRIDS[848] = {
+    0x00, 0x2a, 0xa8, 0x00, 0x02, 0xaa, 0x80, 0x00, 0x0a, 0xaa, 0x00, 0x00, 0xaa, 0xa0, 0x00, 0x02,
+    0xaa, 0x80, 0x00, 0x2a, 0xa8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x0a, 0xaa, 0x00, 0x00, 0x2a, 0xa8,
+    0x02, 0xaa, 0xaa, 0xaa, 0xaa, 0x2a, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0x8a, 0xaa, 0xaa, 0xaa,
+    0xaa, 0xaa, 0xaa, 0xa2, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xa8, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa,
+    0xaa, 0xaa, 0x2a, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0x8a, 0xaa, 0x02, 0x80, 0x2a, 0xa8, 0x28,
+    0x00, 0xaa, 0x80, 0xa0, 0x0a, 0xaa, 0x0a, 0x00, 0x2a, 0xa0, 0x28, 0x02, 0xaa, 0xaa, 0x80, 0x0a,
+    0xaa, 0xaa, 0x00, 0xaa, 0xaa, 0xa0, 0x02, 0xaa, 0xaa, 0x80, 0x00, 0x7f, 0xf8, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x1f, 0xfe, 0x00, 0x00, 0x00, 0x00, 0x00, 0x07, 0xff, 0x80, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x7f, 0xf8, 0x00, 0x00, 0x00, 0x00, 0x3f, 0x7f,
+    0xff, 0xfe, 0x00, 0x00, 0x00, 0x0f, 0xdf, 0xff, 0xff, 0x80, 0x00, 0x00, 0x03, 0xf7, 0xff, 0xff,
+    0xe0, 0x00, 0x00, 0x00, 0xfd, 0xff, 0xff, 0xf8, 0x00, 0x00, 0x00, 0x3f, 0x7f, 0xff, 0xfe, 0x00,
+    0x00, 0x00, 0x0f, 0xdf, 0xff, 0x07, 0x80, 0x00, 0x00, 0x00, 0x01, 0xff, 0xc1, 0xe0, 0x00, 0x00,
+    0x00, 0x00, 0x7f, 0xf0, 0x78, 0x00, 0x00, 0x00, 0x00, 0x1f, 0xff, 0xfe, 0x00, 0x00, 0x00, 0x00,
+    0x07, 0xff, 0xff, 0x80, 0x00, 0x49, 0x20, 0x00, 0x02, 0x49, 0x00, 0x00, 0x12, 0x48, 0x00, 0x00,
+    0x92, 0x40, 0x00, 0x04, 0x92, 0x00, 0x00, 0x24, 0x90, 0x00, 0x00, 0x00, 0x00, 0x00, 0x09, 0x24,
+    0x00, 0x00, 0x49, 0x20, 0x04, 0x82, 0x49, 0x24, 0xa4, 0x12, 0x49, 0x25, 0x20, 0x92, 0x49, 0x29,
+    0x04, 0x92, 0x49, 0x48, 0x24, 0x92, 0x4a, 0x41, 0x24, 0x92, 0x52, 0x09, 0x24, 0x92, 0x90, 0x49,
+    0x24, 0x94, 0x82, 0x49, 0x24, 0xa4, 0x12, 0x49, 0x25, 0x20, 0x92, 0x49, 0x29, 0x04, 0x92, 0x01,
+    0x00, 0x24, 0x90, 0x08, 0x01, 0x24, 0x80, 0x40, 0x09, 0x24, 0x02, 0x00, 0x49, 0x20, 0x10, 0x02,
+    0x49, 0x24, 0x80, 0x12, 0x49, 0x24, 0x00, 0x92, 0x49, 0x20, 0x04, 0x92, 0x49, 0x00, 0x00, 0x49,
+    0x20, 0x00, 0x00, 0x92, 0x40, 0x00, 0x09, 0x24, 0x00, 0x00, 0x92, 0x40, 0x00, 0x01, 0x24, 0x80,
+    0x00, 0x12, 0x48, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x49, 0x00, 0x00, 0x24, 0x90, 0x04, 0x82,
+    0x49, 0x24, 0x89, 0x24, 0x92, 0x48, 0x92, 0x49, 0x24, 0x99, 0x04, 0x92, 0x49, 0x12, 0x49, 0x24,
+    0x91, 0x24, 0x92, 0x49, 0x32, 0x09, 0x24, 0x92, 0x24, 0x92, 0x49, 0x22, 0x49, 0x24, 0x92, 0x64,
+    0x12, 0x49, 0x24, 0x49, 0x24, 0x92, 0x44, 0x92, 0x49, 0x04, 0x80, 0x24, 0x90, 0x08, 0x00, 0x49,
+    0x00, 0x80, 0x04, 0x92, 0x09, 0x00, 0x49, 0x20, 0x10, 0x00, 0x92, 0x49, 0x00, 0x09, 0x24, 0x92,
+    0x00, 0x92, 0x49, 0x20, 0x01, 0x24, 0x92, 0x00, 0x00, 0x0e, 0x38, 0x00, 0x00, 0x71, 0xc0, 0x00,
+    0x1c, 0x70, 0x00, 0x00, 0xe3, 0x80, 0x00, 0x00, 0xe3, 0x80, 0x00, 0x07, 0x1c, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x0e, 0x38, 0x00, 0x00, 0x0e, 0x38, 0x07, 0x0c, 0x71, 0xc7, 0x07, 0x1c, 0x71, 0xc6,
+    0x38, 0xe3, 0x8e, 0x3e, 0x18, 0xe3, 0x8e, 0x70, 0xc7, 0x1c, 0x70, 0x71, 0xc7, 0x1c, 0x63, 0x8e,
+    0x38, 0xe3, 0xe1, 0x8e, 0x38, 0xe7, 0x0c, 0x71, 0xc7, 0x07, 0x1c, 0x71, 0xc6, 0x38, 0xe3, 0x8e,
+    0x3e, 0x18, 0xe3, 0x06, 0x00, 0x07, 0x18, 0x30, 0x01, 0xc7, 0x00, 0x60, 0x0e, 0x38, 0x03, 0x00,
+    0x0e, 0x30, 0x60, 0x00, 0x71, 0xc7, 0x00, 0x1c, 0x71, 0xc6, 0x00, 0xe3, 0x8e, 0x30, 0x00, 0xe3,
+    0x8e, 0x00, 0x00, 0x7f, 0xf8, 0x00, 0x00, 0x41, 0x00, 0x00, 0x12, 0x48, 0x00, 0x00, 0x55, 0x50,
+    0x00, 0x04, 0x92, 0x00, 0x00, 0x04, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x04, 0x00, 0x00,
+    0x49, 0x20, 0x05, 0x45, 0x55, 0x55, 0x64, 0x12, 0x49, 0x25, 0x00, 0x10, 0x41, 0x0f, 0xdf, 0xff,
+    0xff, 0xc0, 0x04, 0x10, 0x42, 0x41, 0x24, 0x92, 0x55, 0x15, 0x55, 0x55, 0x90, 0x49, 0x24, 0x94,
+    0x00, 0x41, 0x04, 0x3f, 0x7f, 0xff, 0xff, 0x00, 0x10, 0x41, 0x09, 0x04, 0x92, 0x01, 0x00, 0x15,
+    0x50, 0x14, 0x01, 0x24, 0x80, 0x40, 0x01, 0x04, 0x00, 0x00, 0x7f, 0xf0, 0x78, 0x00, 0x41, 0x04,
+    0x00, 0x12, 0x49, 0x24, 0x00, 0x55, 0x55, 0x50, 0x04, 0x92, 0x49, 0x00, 0x00, 0x7f, 0xf8, 0x00,
+    0x00, 0x71, 0xc0, 0x00, 0x1b, 0x6c, 0x00, 0x00, 0x55, 0x50, 0x00, 0x05, 0xb6, 0x80, 0x00, 0x1c,
+    0x70, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0xc7, 0x00, 0x00, 0x6d, 0xb0, 0x05, 0x45, 0x55, 0x55,
+    0x6d, 0x36, 0xdb, 0x6d, 0x18, 0x71, 0xc7, 0x1f, 0xdf, 0xff, 0xff, 0xf0, 0xc7, 0x1c, 0x73, 0x65,
+    0xb6, 0xdb, 0x75, 0x15, 0x55, 0x55, 0xb4, 0xdb, 0x6d, 0xb4, 0x61, 0xc7, 0x1c, 0x7f, 0x7f, 0xff,
+    0xff, 0xc3, 0x1c, 0x71, 0xcd, 0x96, 0xdb, 0x05, 0x80, 0x15, 0x50, 0x14, 0x01, 0x6d, 0x80, 0xc0,
+    0x07, 0x1c, 0x01, 0x00, 0x7f, 0xf0, 0x78, 0x00, 0x71, 0xc7, 0x00, 0x1b, 0x6d, 0xb6, 0x00, 0x55,
+    0x55, 0x50, 0x05, 0xb6, 0xdb, 0x00, 0x00, 0x2a, 0xa8, 0x00, 0x03, 0x8e, 0x00, 0x00, 0x0e, 0x38,
+    0x00, 0x00, 0xaa, 0xa0, 0x00, 0x00, 0xe3, 0x80, 0x00, 0x23, 0x8c, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x0e, 0x38, 0x00, 0x00, 0x38, 0xe0, 0x02, 0xaa, 0xaa, 0xaa, 0xb8, 0x63, 0x8e, 0x38, 0xe3, 0x8e,
+    0x38, 0xea, 0x8a, 0xaa, 0xaa, 0x8e, 0x38, 0xe3, 0x8e, 0x30, 0xe3, 0x8e, 0x2a, 0xaa, 0xaa, 0xaa,
+    0xe1, 0x8e, 0x38, 0xe3, 0x8e, 0x38, 0xe3, 0xaa, 0x2a, 0xaa, 0xaa, 0x38, 0xe3, 0x8e, 0x38, 0xc3,
+    0x8e, 0x00, 0x80, 0x2a, 0xa8, 0x28, 0x00, 0x38, 0xc1, 0x80, 0x08, 0xe2, 0x0e, 0x00, 0x2a, 0xa0,
+    0x28, 0x03, 0x8e, 0x38, 0xc0, 0x0e, 0x38, 0xe2, 0x00, 0xaa, 0xaa, 0xa0, 0x00, 0xe3, 0x8e, 0x00,
+};
+
+#endif
+
+static const uint16_t LOCKED_TEMPLATE_PLACEMENT[567] = {
+    840, 839, 811, 810, 782, 781, 753, 752, 724, 723, 695, 694, 666, 665,
+    637, 636, 608, 607, 579, 578, 550, 549, 521, 520, 492, 491, 463, 462,
+    434, 433, 405, 404, 376, 375, 347, 346, 318, 317, 289, 288, 287, 286,
+    316, 315, 345, 344, 374, 373, 403, 402, 432, 431, 461, 460, 490, 489,
+    519, 518, 548, 547, 577, 576, 606, 605, 635, 634, 664, 663, 693, 692,
+    722, 721, 751, 750, 780, 779, 809, 808, 838, 837, 836, 835, 807, 806,
+    778, 777, 749, 748, 575, 574, 546, 545, 517, 516, 488, 487, 459, 458,
+    430, 429, 401, 400, 372, 371, 343, 342, 314, 313, 285, 284, 283, 282,
+    312, 311, 341, 340, 370, 369, 399, 398, 428, 427, 457, 456, 486, 485,
+    515, 514, 544, 543, 573, 572, 747, 746, 776, 775, 805, 804, 834, 833,
+    832, 831, 803, 802, 774, 773, 745, 744, 715, 686, 657, 628, 599, 571,
+    570, 542, 541, 513, 512, 484, 483, 455, 454, 426, 425, 397, 396, 368,
+    367, 339, 338, 310, 309, 281, 280, 252, 251, 223, 222, 165, 164, 136,
+    135, 107, 106,  78,  77,  49,  48,  20,  19,  18,  17,  47,  46,  76,
+     75, 105, 104, 134, 133, 163, 162, 221, 220, 250, 249, 279, 278, 308,
+    307, 337, 336, 366, 365, 395, 394, 424, 423, 453, 452, 482, 481, 511,
+    510, 540, 539, 569, 568, 598, 597, 627, 626, 656, 655, 685, 684, 714,
+    713, 743, 742, 772, 771, 801, 800, 830, 829, 828, 827, 799, 798, 770,
+    769, 741, 740, 712, 711, 683, 682, 654, 653, 625, 624, 596, 595, 567,
+    566, 538, 537, 509, 508, 480, 479, 451, 450, 422, 421, 393, 392, 364,
+    363, 335, 334, 306, 305, 277, 276, 248, 247, 219, 218, 161, 160, 132,
+    131, 103, 102,  74,  73,  45,  44,  16,  15,  14,  13,  43,  42,  72,
+     71, 101, 100, 130, 129, 159, 158, 217, 216, 246, 245, 275, 274, 304,
+    303, 333, 332, 362, 361, 391, 390, 420, 419, 449, 448, 478, 477, 507,
+    506, 536, 535, 565, 564, 594, 593, 623, 622, 652, 651, 681, 680, 710,
+    709, 739, 738, 768, 767, 797, 796, 826, 825, 824, 823, 795, 794, 766,
+    765, 737, 736, 708, 707, 679, 678, 650, 649, 621, 620, 592, 591, 563,
+    562, 534, 533, 505, 504, 476, 475, 447, 446, 418, 417, 389, 388, 360,
+    359, 331, 330, 302, 301, 273, 272, 244, 243, 215, 214, 157, 156, 128,
+    127,  99,  98,  70,  69,  41,  40,  12,  11,  10,   9,  39,  38,  68,
+     67,  97,  96, 126, 125, 155, 154, 213, 212, 242, 241, 271, 270, 300,
+    299, 329, 328, 358, 357, 387, 386, 416, 415, 445, 444, 474, 473, 503,
+    502, 532, 531, 561, 560, 590, 589, 619, 618, 648, 647, 677, 676, 706,
+    705, 735, 734, 764, 763, 793, 792, 822, 821, 588, 587, 559, 558, 530,
+    529, 501, 500, 472, 471, 443, 442, 414, 413, 385, 384, 356, 355, 327,
+    326, 298, 297, 269, 268, 266, 265, 295, 294, 324, 323, 353, 352, 382,
+    381, 411, 410, 440, 439, 469, 468, 498, 497, 527, 526, 556, 555, 585,
+    584, 583, 582, 554, 553, 525, 524, 496, 495, 467, 466, 438, 437, 409,
+    408, 380, 379, 351, 350, 322, 321, 293, 292, 264, 263, 262, 261, 291,
+    290, 320, 319, 349, 348, 378, 377, 407, 406, 436, 435, 465, 464, 494,
+    493, 523, 522, 552, 551, 581, 580,
+};
+
+static const VersionTemplate LOCKED_TEMPLATE = {
+    LOCKED_TEMPLATE_MODULES,
+    LOCKED_TEMPLATE_IS_FUNCTION,
+#if FAST_MASKING
+    LOCKED_TEMPLATE_MASK_GRIDS,
+#else
+    NULL,
+#endif
+    LOCKED_TEMPLATE_PLACEMENT,
+};
+
+static const VersionTemplate* getVersionTemplate(uint8_t version) {
+    (void)version;
+    return &LOCKED_TEMPLATE;
 }
 
-int8_t qrcode_initText(QRCode *qrcode, uint8_t *modules, uint8_t version, uint8_t ecc, const char *data) {
-    return qrcode_initBytes(qrcode, modules, version, ecc, (uint8_t*)data, strlen(data));
+#endif
+
+#endif
+
+static uint16_t getDataCapacity(uint8_t version, uint8_t eccFormatBits) {
+#if LOCK_VERSION == 0
+    return NUM_RAW_DATA_MODULES[version - 1] / 8 - NUM_ERROR_CORRECTION_CODEWORDS[eccFormatBits][version - 1];
+#else
+    (void)version;
+    return NUM_RAW_DATA_MODULES / 8 - NUM_ERROR_CORRECTION_CODEWORDS[eccFormatBits];
+#endif
 }
 
-bool qrcode_getModule(QRCode *qrcode, uint8_t x, uint8_t y) {
-    if (x < 0 || x >= qrcode->size || y < 0 || y >= qrcode->size) {
-        return false;
+// Returns the number of bits encodeDataCodewords will produce for the data at the given
+// version (plus headerBits for the ECI and Structured Append headers), or UINT32_MAX if a
+// length does not fit in its character count field. If charModes is non-NULL, the data is
+// segmented into it (see segmentData), unless a single segment is no longer, in which case
+// every entry is set to the mode of that segment.
+static uint32_t getEncodedBitLength(const DataParts *data, uint8_t version, bool kanji, uint8_t headerBits, uint8_t *charModes) {
+    uint16_t length = data->length;
+    uint8_t mode = getDataMode(data, kanji);
+    uint32_t bits = getSegmentBits(mode, length, version);
+    
+    if (charModes && length > 0) {
+        segmentData(data, version, kanji, charModes);
+        uint32_t segmentedBits = getSegmentedBits(charModes, length, version);
+        if (segmentedBits < bits) {
+            bits = segmentedBits;
+        } else {
+            memset(charModes, mode, length);
+        }
     }
+    
+    if (bits == UINT32_MAX) { return bits; }
+    return bits + headerBits;
+}
 
-    uint32_t offset = y * qrcode->size + x;
-    return (qrcode->modules[offset >> 3] & (1 << (7 - (offset & 0x07)))) != 0;
+static uint32_t getDataCapacityBits(uint8_t version, uint8_t ecc) {
+    uint8_t eccFormatBits = (ECC_FORMAT_BITS >> (2 * ecc)) & 0x03;
+    return 8 * (uint32_t)getDataCapacity(version, eccFormatBits);
+}
+
+// Returns the most characters any data could have and still fit in the version (as digits)
+static uint16_t getMaxCharacters(uint8_t version) {
+    return getDataCapacityBits(version, ECC_LOW) * 3 / 10 + 1;
+}
+
+// Returns the smallest version the data fits in at the given error correction level, or 0.
+// The encoded length at that version is stored into bits, and the modes into charModes (if
+// non-NULL, as for getEncodedBitLength).
+static uint8_t getMinimumVersion(uint8_t ecc, const DataParts *data, bool kanji, uint8_t headerBits, uint8_t *charModes, uint32_t *bits) {
+#if LOCK_VERSION == 0
+    uint32_t encodedBits = 0;
+    for (uint8_t version = 1; version <= 40; version++) {
+        // The encoded length only changes along with the character count field sizes
+        if (version == 1 || version == 10 || version == 27) {
+            encodedBits = getEncodedBitLength(data, version, kanji, headerBits, charModes);
+        }
+#else
+    {
+        uint8_t version = LOCK_VERSION;
+        uint32_t encodedBits = getEncodedBitLength(data, version, kanji, headerBits, charModes);
+#endif
+        if (encodedBits <= getDataCapacityBits(version, ecc)) {
+            *bits = encodedBits;
+            return version;
+        }
+    }
+    
+    return 0;
+}
+
+// Returns the arena size encodeSymbol needs (for any error correction level), given a version
+// template (with its mask grids, for FAST_MASKING) if withTemplate is set
+static uint32_t getScratchSize(uint8_t version, const QRCodeOptions *options, bool withTemplate) {
+    uint8_t size = version * 4 + 17;
+    uint16_t gridBytes = bb_getGridSizeBytes(size);
+    
+#if LOCK_VERSION == 0
+    uint16_t codewordBytes = bb_getBufferSizeBytes(NUM_RAW_DATA_MODULES[version - 1]);
+#else
+    uint16_t codewordBytes = bb_getBufferSizeBytes(NUM_RAW_DATA_MODULES);
+#endif
+    
+    // Every allocation is counted, placeholders included, as each may take up to 7 more
+    // bytes for alignment. First those held for the whole encode: the character modes
+    // (a placeholder unless segmenting; also all that choosing the versions of a batch or a
+    // Structured Append plan takes), the codewords, and the function grid (a placeholder
+    // with a template).
+    bool segmented = (options && options->optimizeSegments);
+    uint32_t result = arena_getSize(segmented ? getMaxCharacters(version): 1);
+    result += arena_getSize(codewordBytes);
+    result += arena_getSize(withTemplate ? 1: gridBytes);
+    
+    // Error correction: the interleaved result and the generator polynomial (of at most 30
+    // coefficients, the longest block error correction)
+    uint32_t eccSize = arena_getSize(codewordBytes) + arena_getSize(30);
+    
+    // Mask selection: serially, the mask grid (a placeholder with a template) and the rows of
+    // the penalty scorer; concurrently, the candidate grids and the scorers' rows
+    uint32_t maskSize = getPenaltyScratchSize(size);
+#if FAST_MASKING
+    maskSize += arena_getSize(withTemplate ? 1: gridBytes);
+#endif
+    if (options && options->executor) {
+        uint32_t concurrentSize = arena_getSize(8 * gridBytes);
+        if (getPenaltyScratchSize(size)) { concurrentSize += arena_getSize(8 * getPenaltyScratchSize(size)); }
+        if (concurrentSize > maskSize) { maskSize = concurrentSize; }
+    }
+    
+    return result + ((eccSize > maskSize) ? eccSize: maskSize);
+}
+
+// Encodes a symbol; if versionTemplate is non-NULL, it must have been built for this version,
+// otherwise the cached template is used (with TEMPLATE_CACHE) or the patterns are drawn.
+// If arena is non-NULL, it must hold getScratchSize bytes. A version of 0 selects the smallest
+// version the data fits in; otherwise a nonzero bits is the encoded length of the data at that
+// version, already checked to fit (so only the character modes are found again, if segmenting).
+// If sequence is non-NULL, the symbol is part of a Structured Append sequence.
+static int8_t encodeSymbol(QRCode *qrcode, uint8_t *modules, uint8_t version, uint32_t bits, uint8_t ecc, const DataParts *data, const QRCodeOptions *options, const Sequence *sequence, const VersionTemplate *versionTemplate, Arena *arena) {
+    uint32_t eci = (options ? options->eci: 0);
+    if (version > 40 || ecc > ECC_HIGH || eci >= 1000000) { return QRCODE_ERROR_INVALID_ARGUMENT; }
+    if (options && (options->maskPolicy > MASK_FIXED || (options->maskPolicy == MASK_FIXED && options->fixedMask > 7))) { return QRCODE_ERROR_INVALID_ARGUMENT; }
+    uint8_t headerBits = getEciBits(eci) + (sequence ? SEQUENCE_HEADER_BITS: 0);
+    
+#if LOCK_VERSION != 0
+    if (version != 0) { version = LOCK_VERSION; }
+#endif
+    
+    // Take the scratch buffers from the caller's workspace, if there is one
+    Arena workspace;
+    if (!arena && options && options->workspace) {
+        if (options->workspaceSize < qrcode_getWorkspaceSize(version, options)) { return QRCODE_ERROR_INVALID_ARGUMENT; }
+        workspace.data = options->workspace;
+        workspace.used = 0;
+        workspace.capacity = options->workspaceSize;
+        arena = &workspace;
+    }
+    
+    // Segmenting needs a mode per character; longer data could not fit anyway
+    bool segmented = (options && options->optimizeSegments);
+    bool kanji = (options && options->kanji);
+    if (segmented && data->length > getMaxCharacters(version ? version: 40)) { return QRCODE_ERROR_DATA_TOO_LONG; }
+    
+    SCRATCH_MARK(arena);
+    SCRATCH_BUFFER(uint8_t, charModesBytes, segmented ? max(data->length, 1): 1, arena);
+    uint8_t *charModes = segmented ? charModesBytes: NULL;
+    
+    if (version == 0) {
+        version = getMinimumVersion(ecc, data, kanji, headerBits, charModes, &bits);
+    } else if (bits == 0 || segmented) {
+        bits = getEncodedBitLength(data, version, kanji, headerBits, charModes);
+        if (bits > getDataCapacityBits(version, ecc)) { version = 0; }
+    }
+    
+    if (version == 0) {
+        SCRATCH_RELEASE(arena);
+        return QRCODE_ERROR_DATA_TOO_LONG;
+    }
+    
+    // Use the strongest error correction which still fits in the same version
+    if (options && options->boostEcc) {
+        while (ecc < ECC_HIGH && bits <= getDataCapacityBits(version, ecc + 1)) { ecc++; }
+    }
+    
+    uint8_t size = version * 4 + 17;
+    qrcode->version = version;
+    qrcode->size = size;
+    qrcode->ecc = ecc;
+    qrcode->modules = modules;
+    
+    uint8_t eccFormatBits = (ECC_FORMAT_BITS >> (2 * ecc)) & 0x03;
+    
+#if LOCK_VERSION == 0
+    uint16_t moduleCount = NUM_RAW_DATA_MODULES[version - 1];
+#else
+    uint16_t moduleCount = NUM_RAW_DATA_MODULES;
+#endif
+    uint16_t dataCapacity = getDataCapacity(version, eccFormatBits);
+    
+#if TEMPLATE_CACHE
+    if (!versionTemplate) { versionTemplate = getVersionTemplate(version); }
+#endif
+    
+    struct BitBucket codewords;
+    SCRATCH_BUFFER(uint8_t, codewordBytes, bb_getBufferSizeBytes(moduleCount), arena);
+    bb_initBuffer(&codewords, codewordBytes, bb_getBufferSizeBytes(moduleCount));
+    
+    // Place the headers and data code words into the buffer
+    if (sequence) { appendSequence(&codewords, sequence); }
+    appendEci(&codewords, eci);
+    qrcode->mode = encodeDataCodewords(&codewords, data, version, kanji, charModes);
+    
+    // Add terminator and pad up to a byte if applicable
+    uint32_t padding = (dataCapacity * 8) - codewords.bitOffsetOrWidth;
+    if (padding > 4) { padding = 4; }
+    bb_appendBits(&codewords, 0, padding);
+    bb_appendBits(&codewords, 0, (8 - codewords.bitOffsetOrWidth % 8) % 8);
+
+    // Pad with alternate bytes until data capacity is reached
+    for (uint8_t padByte = 0xEC; codewords.bitOffsetOrWidth < (dataCapacity * 8); padByte ^= 0xEC ^ 0x11) {
+        bb_appendBits(&codewords, padByte, 8);
+    }
+
+    BitBucket modulesGrid;
+    BitBucket isFunctionGrid;
+    SCRATCH_BUFFER(uint8_t, isFunctionGridBytes, versionTemplate ? 1: bb_getGridSizeBytes(size), arena);
+    const uint8_t *maskGrids = NULL;
+    
+    // Draw function patterns (or copy them from the template)
+    if (versionTemplate) {
+        modulesGrid.bitOffsetOrWidth = size;
+        modulesGrid.capacityBytes = bb_getGridSizeBytes(size);
+        modulesGrid.data = modules;
+        memcpy(modules, versionTemplate->modules, modulesGrid.capacityBytes);
+        
+        isFunctionGrid = modulesGrid;
+        isFunctionGrid.data = (uint8_t*)versionTemplate->isFunction;  // Only read
+        
+        maskGrids = versionTemplate->maskGrids;
+        
+    } else {
+        bb_initGrid(&modulesGrid, modules, size);
+        bb_initGrid(&isFunctionGrid, isFunctionGridBytes, size);
+        drawFunctionPatterns(&modulesGrid, &isFunctionGrid, version, eccFormatBits);
+    }
+    
+    // Draw all codewords, do masking
+    performErrorCorrection(version, eccFormatBits, &codewords, arena);
+    if (versionTemplate && versionTemplate->placement) {
+        drawCodewordsPlaced(&modulesGrid, versionTemplate->placement, &codewords);
+    } else {
+        drawCodewords(&modulesGrid, &isFunctionGrid, &codewords);
+    }
+    
+    // Find the best (lowest penalty) mask of the candidates, and apply it
+    uint8_t maskCandidates = getMaskCandidates(options);
+    uint8_t mask;
+    if (options && options->executor && (maskCandidates & (maskCandidates - 1)) != 0) {
+        mask = applyBestMaskConcurrently(&modulesGrid, &isFunctionGrid, eccFormatBits, maskGrids, maskCandidates, options, arena);
+    } else {
+        mask = applyBestMask(&modulesGrid, &isFunctionGrid, eccFormatBits, maskGrids, maskCandidates, arena);
+    }
+    
+    qrcode->mask = mask;
+    
+    SCRATCH_RELEASE(arena);
+
+    return QRCODE_OK;
+}
+
+
+#pragma mark - Image Output
+
+// The bytes of a 1-bit raster scanline produced at a time by the image writers
+#define RASTER_CHUNK_BYTES   64
+
+// Sets bits [from, to) of a scanline, most significant first
+static void setBitRange(uint8_t *line, uint32_t from, uint32_t to) {
+    if (from >= to) { return; }
+    
+    uint32_t first = from >> 3, last = (to - 1) >> 3;
+    uint8_t head = 0xff >> (from & 0x07), tail = (uint8_t)(0xff << (7 - ((to - 1) & 0x07)));
+    if (first == last) {
+        line[first] |= head & tail;
+        return;
+    }
+    
+    line[first] |= head;
+    memset(&line[first + 1], 0xff, last - first - 1);
+    line[last] |= tail;
+}
+
+// Finds the first run of dark modules in a row (as qrcode_getRow) starting at or after
+// module x, skipping bytes of 8 light modules; sets x and end (just past the run), or
+// returns false if there are none
+static bool nextDarkRun(const uint8_t *row, uint8_t size, uint8_t *x, uint8_t *end) {
+    uint8_t start = *x;
+    while (start < size && !(row[start >> 3] & (0x80 >> (start & 0x07)))) {
+        start += ((start & 0x07) == 0 && row[start >> 3] == 0) ? 8: 1;
+    }
+    if (start >= size) { return false; }
+    
+    uint8_t stop = start + 1;
+    while (stop < size && (row[stop >> 3] & (0x80 >> (stop & 0x07)))) { stop++; }
+    
+    *x = start;
+    *end = stop;
+    return true;
+}
+
+// Fills count bytes (from byte start) of the 1-bit scanline of a row of modules (as
+// qrcode_getRow, or NULL for the quiet zone), setting the bits of each run of dark modules
+// at once
+static void fillRasterLine(const uint8_t *row, uint8_t size, uint8_t scale, uint8_t border, uint32_t start, uint8_t *line, uint16_t count) {
+    memset(line, 0, count);
+    if (row == NULL) { return; }
+    
+    uint32_t first = start * 8, last = first + count * 8;
+    uint32_t offset = (uint32_t)border * scale;
+    
+    uint32_t skip = (first > offset) ? (first - offset) / scale: 0;
+    if (skip >= size) { return; }
+    
+    uint8_t x = skip, end;
+    while (nextDarkRun(row, size, &x, &end) && offset + (uint32_t)x * scale < last) {
+        uint32_t from = offset + (uint32_t)x * scale, to = offset + (uint32_t)end * scale;
+        setBitRange(line, ((from > first) ? from: first) - first, ((to < last) ? to: last) - first);
+        x = end;
+    }
+}
+
+// Writes every pixel row of the raster, padded to stride bytes (bottom row first if
+// bottomUp), through the writer a chunk at a time
+static int8_t writeRaster(QRCode *qrcode, uint8_t scale, uint8_t border, uint32_t stride, bool bottomUp, QRCodeWriter writer, void *context) {
+    uint8_t size = qrcode->size;
+    uint16_t height = size + 2 * border;
+    
+    uint8_t row[(177 + 7) / 8];
+    uint8_t chunk[RASTER_CHUNK_BYTES];
+    
+    for (uint16_t i = 0; i < height; i++) {
+        int16_t y = bottomUp ? (size + border - 1 - i): (i - border);
+        bool inside = (y >= 0 && y < size);
+        if (inside) { qrcode_getRow(qrcode, y, row); }
+        
+        // Each row of modules is scale rows of pixels; a scanline that fits in one chunk
+        // is only filled once for all of them
+        for (uint8_t repeat = 0; repeat < scale; repeat++) {
+            for (uint32_t start = 0; start < stride; start += RASTER_CHUNK_BYTES) {
+                uint16_t count = (stride - start < RASTER_CHUNK_BYTES) ? (stride - start): RASTER_CHUNK_BYTES;
+                if (repeat == 0 || stride > RASTER_CHUNK_BYTES) {
+                    fillRasterLine(inside ? row: NULL, size, scale, border, start, chunk, count);
+                }
+                if (!writer(context, chunk, count)) { return QRCODE_ERROR_WRITE_FAILED; }
+            }
+        }
+    }
+    
+    return QRCODE_OK;
+}
+
+// Appends the decimal digits of value to text, returning the new end
+static char* appendDecimal(char *text, uint32_t value) {
+    char digits[10];
+    uint8_t count = 0;
+    do {
+        digits[count++] = '0' + (value % 10);
+        value /= 10;
+    } while (value);
+    
+    while (count) { *text++ = digits[--count]; }
+    return text;
+}
+
+// Stores value in little-endian byte order
+static void putLittleEndian(uint8_t *bytes, uint32_t value, uint8_t length) {
+    for (uint8_t i = 0; i < length; i++) {
+        bytes[i] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+
+// Stores value in big-endian (network) byte order
+static void putBigEndian(uint8_t *bytes, uint32_t value, uint8_t length) {
+    for (uint8_t i = 0; i < length; i++) {
+        bytes[i] = (uint8_t)(value >> (8 * (length - 1 - i)));
+    }
+}
+
+// The bytes of compressed image data in each PNG IDAT chunk
+#define PNG_CHUNK_BYTES   256
+
+// The CRC-32 of each 4 bit value, for the PNG chunk checksums
+static const uint32_t CRC32_NIBBLES[16] = {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t *data, uint32_t length) {
+    while (length--) {
+        crc ^= *data++;
+        crc = (crc >> 4) ^ CRC32_NIBBLES[crc & 0x0f];
+        crc = (crc >> 4) ^ CRC32_NIBBLES[crc & 0x0f];
+    }
+    return crc;
+}
+
+// A PNG being written: the zlib stream of the image data is compressed as a single block
+// of fixed Huffman codes, and sent through the writer as IDAT chunks as each fills
+typedef struct PngWriter {
+    QRCodeWriter writer;
+    void *context;
+    bool failed;
+    
+    // The Adler-32 sums of the uncompressed data
+    uint32_t adlerA;
+    uint32_t adlerB;
+    
+    // Bits not yet forming a whole byte (least significant first, as deflate packs them)
+    uint32_t bits;
+    uint8_t bitCount;
+    
+    // The byte most recently sent as a literal (or -1), and how many times it has been
+    // repeated since; repeats are sent as a copy of the previous byte
+    int16_t literal;
+    uint16_t repeats;
+    
+    // The chunk being filled (after its length and type)
+    uint16_t length;
+    uint8_t chunk[8 + PNG_CHUNK_BYTES + 4];
+} PngWriter;
+
+// Writes a chunk of the given type, with its length and CRC
+static void png_writeChunk(PngWriter *png, const char *type, uint8_t *chunk, uint32_t length) {
+    if (png->failed) { return; }
+    
+    putBigEndian(chunk, length, 4);
+    memcpy(&chunk[4], type, 4);
+    putBigEndian(&chunk[8 + length], crc32_update(0xffffffff, &chunk[4], 4 + length) ^ 0xffffffff, 4);
+    if (!png->writer(png->context, chunk, 8 + length + 4)) { png->failed = true; }
+}
+
+static void png_appendByte(PngWriter *png, uint8_t value) {
+    png->chunk[8 + png->length++] = value;
+    if (png->length == PNG_CHUNK_BYTES) {
+        png_writeChunk(png, "IDAT", png->chunk, png->length);
+        png->length = 0;
+    }
+}
+
+static void png_appendBits(PngWriter *png, uint32_t value, uint8_t count) {
+    png->bits |= value << png->bitCount;
+    png->bitCount += count;
+    while (png->bitCount >= 8) {
+        png_appendByte(png, (uint8_t)png->bits);
+        png->bits >>= 8;
+        png->bitCount -= 8;
+    }
+}
+
+// Appends a Huffman code, which deflate packs most significant bit first
+static void png_appendCode(PngWriter *png, uint16_t code, uint8_t count) {
+    uint16_t reversed = 0;
+    for (uint8_t i = 0; i < count; i++) {
+        reversed = (reversed << 1) | ((code >> i) & 1);
+    }
+    png_appendBits(png, reversed, count);
+}
+
+// Appends a literal byte (or the end of block, 256) in the fixed Huffman code
+static void png_appendSymbol(PngWriter *png, uint16_t symbol) {
+    if (symbol < 144) {
+        png_appendCode(png, 0x30 + symbol, 8);
+    } else if (symbol < 256) {
+        png_appendCode(png, 0x190 + symbol - 144, 9);
+    } else if (symbol < 280) {
+        png_appendCode(png, symbol - 256, 7);
+    } else {
+        png_appendCode(png, 0xc0 + symbol - 280, 8);
+    }
+}
+
+// Returns floor(log2(value)) for a non-zero value
+static uint8_t png_log2(uint32_t value) {
+    uint8_t result = 0;
+    while (value >>= 1) { result++; }
+    return result;
+}
+
+// Appends a copy of length (3 to 258) bytes from distance (1 to 32768) bytes back; each
+// length and distance code covers a power of 2 range, split in 4 (or 2) by its top bits
+static void png_appendCopy(PngWriter *png, uint16_t length, uint16_t distance) {
+    uint16_t value = length - 3;
+    if (length == 258) {
+        png_appendSymbol(png, 285);
+    } else if (value < 8) {
+        png_appendSymbol(png, 257 + value);
+    } else {
+        uint8_t extra = png_log2(value) - 2;
+        png_appendSymbol(png, 257 + 4 * (extra + 1) + ((value >> extra) - 4));
+        png_appendBits(png, value & ((1 << extra) - 1), extra);
+    }
+    
+    value = distance - 1;
+    if (value < 4) {
+        png_appendCode(png, value, 5);
+    } else {
+        uint8_t extra = png_log2(value) - 1;
+        png_appendCode(png, 2 * extra + 2 + ((value >> extra) & 1), 5);
+        png_appendBits(png, value & ((1 << extra) - 1), extra);
+    }
+}
+
+// Sends the repeats of the last literal, as a copy if long enough
+static void png_flushRepeats(PngWriter *png) {
+    if (png->repeats >= 3) {
+        png_appendCopy(png, png->repeats, 1);
+    } else {
+        while (png->repeats--) { png_appendSymbol(png, png->literal); }
+    }
+    png->repeats = 0;
+}
+
+// Adds uncompressed bytes to the Adler-32 sums (taking the modulo once per call, which cannot
+// overflow for the at most RASTER_CHUNK_BYTES added at a time)
+static void png_addAdler(PngWriter *png, const uint8_t *data, uint16_t length) {
+    for (uint16_t i = 0; i < length; i++) {
+        png->adlerA += data[i];
+        png->adlerB += png->adlerA;
+    }
+    png->adlerA %= 65521;
+    png->adlerB %= 65521;
+}
+
+// Compresses bytes, replacing runs of a repeated byte (such as the light or dark pixels
+// of a module) with copies of the byte before
+static void png_compress(PngWriter *png, const uint8_t *data, uint16_t length) {
+    png_addAdler(png, data, length);
+    for (uint16_t i = 0; i < length; i++) {
+        if (data[i] == png->literal && png->repeats < 258) {
+            png->repeats++;
+            continue;
+        }
+        png_flushRepeats(png);
+        png_appendSymbol(png, data[i]);
+        png->literal = data[i];
+    }
+}
+
+// Compresses an exact repeat of the previous length bytes as copies of them
+static void png_compressRepeat(PngWriter *png, uint32_t length) {
+    png_flushRepeats(png);
+    png->literal = -1;
+    
+    for (uint32_t remaining = length; remaining > 0; ) {
+        uint16_t count = (remaining > 258) ? ((remaining - 258 < 3) ? (remaining - 3): 258): remaining;
+        png_appendCopy(png, count, length);
+        remaining -= count;
+    }
+}
+
+
+// Text being produced by the vector writers, either copied into a buffer (as snprintf
+// does) or sent through a writer a chunk at a time, and counted either way
+typedef struct TextOutput {
+    char *buffer;
+    uint32_t capacity;
+    QRCodeWriter writer;
+    void *context;
+    bool failed;
+    
+    uint32_t length;
+    uint8_t count;
+    char chunk[RASTER_CHUNK_BYTES];
+} TextOutput;
+
+static void text_init(TextOutput *output, char *buffer, uint32_t capacity, QRCodeWriter writer, void *context) {
+    memset(output, 0, sizeof(TextOutput));
+    output->buffer = buffer;
+    output->capacity = capacity;
+    output->writer = writer;
+    output->context = context;
+}
+
+static void text_append(TextOutput *output, const char *text) {
+    for (; *text; text++) {
+        if (output->writer) {
+            if (output->count == sizeof(output->chunk)) {
+                if (!output->failed && !output->writer(output->context, (const uint8_t*)output->chunk, output->count)) { output->failed = true; }
+                output->count = 0;
+            }
+            output->chunk[output->count++] = *text;
+        } else if (output->length < output->capacity) {
+            output->buffer[output->length] = *text;
+        }
+        output->length++;
+    }
+}
+
+static void text_appendDecimal(TextOutput *output, uint32_t value) {
+    char digits[11];
+    *appendDecimal(digits, value) = 0;
+    text_append(output, digits);
+}
+
+// Sends the last chunk, or terminates the buffer (truncating it if full); returns the
+// length of the whole text, as snprintf does
+static uint32_t text_finish(TextOutput *output) {
+    if (output->writer) {
+        if (output->count && !output->failed && !output->writer(output->context, (const uint8_t*)output->chunk, output->count)) { output->failed = true; }
+        output->count = 0;
+    } else if (output->capacity) {
+        output->buffer[(output->length < output->capacity) ? output->length: (output->capacity - 1)] = 0;
+    }
+    return output->length;
+}
+
+// An SVG of the symbol, with a unit per module; each run of dark modules in a row is one
+// rectangle in a single path, rather than a square per module
+static void appendSvg(QRCode *qrcode, uint8_t border, TextOutput *output) {
+    uint16_t width = qrcode->size + 2 * border;
+    text_append(output, "<svg xmlns=\"http://www.w3.org/2000/svg\" version=\"1.1\" viewBox=\"0 0 ");
+    text_appendDecimal(output, width);
+    text_append(output, " ");
+    text_appendDecimal(output, width);
+    text_append(output, "\" stroke=\"none\">\n<rect width=\"100%\" height=\"100%\" fill=\"#FFFFFF\"/>\n<path d=\"");
+    
+    uint8_t row[(177 + 7) / 8];
+    for (uint8_t y = 0; y < qrcode->size; y++) {
+        qrcode_getRow(qrcode, y, row);
+        
+        uint8_t x = 0, end;
+        while (nextDarkRun(row, qrcode->size, &x, &end)) {
+            text_append(output, "M");
+            text_appendDecimal(output, border + x);
+            text_append(output, " ");
+            text_appendDecimal(output, border + y);
+            text_append(output, "h");
+            text_appendDecimal(output, end - x);
+            text_append(output, "v1h-");
+            text_appendDecimal(output, end - x);
+            x = end;
+        }
+    }
+    
+    text_append(output, "\" fill=\"#000000\"/>\n</svg>\n");
+}
+
+// A PDF content stream filling a rectangle for each run of dark modules in a row, with
+// a unit per module and the origin at the bottom left of the quiet zone
+static void appendPdfContent(QRCode *qrcode, uint8_t border, TextOutput *output) {
+    text_append(output, "0 g\n");
+    
+    uint8_t row[(177 + 7) / 8];
+    for (uint8_t y = 0; y < qrcode->size; y++) {
+        qrcode_getRow(qrcode, y, row);
+        
+        uint8_t x = 0, end;
+        while (nextDarkRun(row, qrcode->size, &x, &end)) {
+            text_appendDecimal(output, border + x);
+            text_append(output, " ");
+            text_appendDecimal(output, border + qrcode->size - 1 - y);
+            text_append(output, " ");
+            text_appendDecimal(output, end - x);
+            text_append(output, " 1 re\n");
+            x = end;
+        }
+    }
+    
+    text_append(output, "f\n");
+}
+
+
+// The characters drawn for each pair of modules above each other in a line of text (the top
+// module is bit 1 and the bottom module bit 0 of the index, set for dark): UTF-8 half and full
+// blocks, or an ASCII approximation
+static const char* const TEXT_GLYPHS[2][4] = {
+    { " ", "\xe2\x96\x84", "\xe2\x96\x80", "\xe2\x96\x88" },
+    { " ", ",", "\"", "#" }
+};
+
+// A line of text drawing two rows of modules (from -border), ending in a newline
+static void appendTextLine(QRCode *qrcode, uint16_t line, uint8_t border, uint8_t style, TextOutput *output) {
+    uint8_t size = qrcode->size;
+    
+    uint8_t rows[2][(177 + 7) / 8];
+    for (uint8_t i = 0; i < 2; i++) {
+        int16_t y = 2 * line + i - border;
+        if (y >= 0 && y < size) {
+            qrcode_getRow(qrcode, y, rows[i]);
+        } else {
+            memset(rows[i], 0, sizeof(rows[i]));
+        }
+    }
+    
+    const char* const *glyphs = TEXT_GLYPHS[(style & TEXT_ASCII) ? 1: 0];
+    uint8_t invert = (style & TEXT_INVERTED) ? 3: 0;
+    
+    for (uint8_t x = 0; x < border; x++) { text_append(output, glyphs[invert]); }
+    for (uint8_t x = 0; x < size; x++) {
+        uint8_t mask = 0x80 >> (x & 0x07);
+        uint8_t index = ((rows[0][x >> 3] & mask) ? 2: 0) | ((rows[1][x >> 3] & mask) ? 1: 0);
+        text_append(output, glyphs[index ^ invert]);
+    }
+    for (uint8_t x = 0; x < border; x++) { text_append(output, glyphs[invert]); }
+    
+    text_append(output, "\n");
+}
+
+
+#pragma mark - Public QRCode functions
+
+uint16_t qrcode_getBufferSize(uint8_t version) {
+    return bb_getGridSizeBytes(4 * version + 17);
+}
+
+uint32_t qrcode_getWorkspaceSize(uint8_t version, const QRCodeOptions *options) {
+#if LOCK_VERSION != 0
+    version = LOCK_VERSION;
+#endif
+    if (version == 0 || version > 40) { version = 40; }
+    
+    // The template cache may fail to allocate, so leave room to draw the patterns
+    return getScratchSize(version, options, false);
+}
+
+uint8_t qrcode_getMinimumVersion(uint8_t ecc, const uint8_t *data, uint16_t length) {
+    if (ecc > ECC_HIGH) { return 0; }
+    
+    DataParts parts = { &data, &length, 1, length };
+    uint32_t bits;
+    return getMinimumVersion(ecc, &parts, false, 0, NULL, &bits);
+}
+
+int8_t qrcode_initBytesWithOptions(QRCode *qrcode, uint8_t *modules, uint8_t version, uint8_t ecc, const uint8_t *data, uint16_t length, const QRCodeOptions *options) {
+    DataParts parts = { &data, &length, 1, length };
+    return encodeSymbol(qrcode, modules, version, 0, ecc, &parts, options, NULL, NULL, NULL);
+}
+
+int8_t qrcode_initPartsWithOptions(QRCode *qrcode, uint8_t *modules, uint8_t version, uint8_t ecc, const uint8_t *const *parts, const uint16_t *lengths, uint8_t count, const QRCodeOptions *options) {
+    uint32_t length = 0;
+    for (uint8_t i = 0; i < count; i++) { length += lengths[i]; }
+    if (length > UINT16_MAX) { return QRCODE_ERROR_DATA_TOO_LONG; }
+    
+    DataParts data = { parts, lengths, count, (uint16_t)length };
+    return encodeSymbol(qrcode, modules, version, 0, ecc, &data, options, NULL, NULL, NULL);
+}
+
+int8_t qrcode_initBytes(QRCode *qrcode, uint8_t *modules, uint8_t version, uint8_t ecc, uint8_t *data, uint16_t length) {
+    return qrcode_initBytesWithOptions(qrcode, modules, version, ecc, data, length, NULL);
+}
+
+int8_t qrcode_beginStream(QRCodeStream *stream, QRCode *qrcode, uint8_t *modules, uint8_t version, uint8_t ecc, const QRCodeOptions *options) {
+    stream->qrcode = qrcode;
+    stream->modules = modules;
+    stream->options = options;
+    stream->length = 0;
+    stream->count = 0;
+    stream->version = version;
+    stream->ecc = ecc;
+    stream->result = QRCODE_OK;
+    
+    uint32_t eci = (options ? options->eci: 0);
+    if (version > 40 || ecc > ECC_HIGH || eci >= 1000000) {
+        stream->result = QRCODE_ERROR_INVALID_ARGUMENT;
+    }
+    
+    return stream->result;
+}
+
+int8_t qrcode_feedStream(QRCodeStream *stream, const uint8_t *data, uint16_t length) {
+    if (stream->result != QRCODE_OK || length == 0) { return stream->result; }
+    
+    if (stream->count == STREAM_MAX_PIECES) {
+        stream->result = QRCODE_ERROR_INVALID_ARGUMENT;
+    } else if (length > UINT16_MAX - stream->length) {
+        stream->result = QRCODE_ERROR_DATA_TOO_LONG;
+    } else {
+        stream->pieces[stream->count] = data;
+        stream->lengths[stream->count] = length;
+        stream->count++;
+        stream->length += length;
+    }
+    
+    return stream->result;
+}
+
+int8_t qrcode_finishStream(QRCodeStream *stream) {
+    if (stream->result != QRCODE_OK) { return stream->result; }
+    
+    stream->result = qrcode_initPartsWithOptions(stream->qrcode, stream->modules, stream->version, stream->ecc, stream->pieces, stream->lengths, stream->count, stream->options);
+    return stream->result;
+}
+
+uint32_t qrcode_initBatch(QRCodeBatchItem *items, uint32_t count, const QRCodeOptions *options) {
+    // Each item's version is resolved as it is encoded. With TEMPLATE_CACHE, every symbol
+    // shares the cached template of its version; without it, each draws its own patterns, as
+    // sharing them would need several grids of scratch
+    uint32_t encoded = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        QRCodeBatchItem *item = &items[i];
+        
+        DataParts parts = { &item->data, &item->length, 1, item->length };
+        item->result = encodeSymbol(&item->qrcode, item->modules, item->version, 0, item->ecc, &parts, options, NULL, NULL, NULL);
+        if (item->result == QRCODE_OK) { encoded++; }
+    }
+    
+    return encoded;
+}
+
+void qrcode_getGeneratorStats(uint32_t *hits, uint32_t *misses) {
+    if (hits) { *hits = ATOMIC_LOAD(generatorHits); }
+    if (misses) { *misses = ATOMIC_LOAD(generatorMisses); }
+}
+
+#if USE_PTHREADS
+
+// Resolves the version of each item into item->qrcode.version and the encoded length of its
+// data there into bits (marking the items which fit no version as failed), and sets a bit in
+// versions for each one used. Returns the largest.
+static uint8_t resolveBatchVersions(QRCodeBatchItem *items, uint32_t count, const QRCodeOptions *options, uint64_t *versions, uint32_t *bits) {
+    // Segmenting needs a mode per character, for the longest item which could fit
+    bool segmented = (options && options->optimizeSegments);
+    bool kanji = (options && options->kanji);
+    uint32_t eci = (options ? options->eci: 0);
+    uint16_t maxLength = getMaxCharacters(LOCK_VERSION ? LOCK_VERSION: 40);
+    uint16_t charModesLength = 1;
+    for (uint32_t i = 0; segmented && i < count; i++) {
+        if (items[i].version == 0 && items[i].length <= maxLength && items[i].length > charModesLength) { charModesLength = items[i].length; }
+    }
+    
+    // Take them from the caller's workspace, if there is one; as for a single encode, choosing
+    // the version needs it to be large enough for any
+    Arena workspace;
+    Arena *arena = NULL;
+    bool canChoose = true;
+    if (segmented && options->workspace) {
+        if (options->workspaceSize < qrcode_getWorkspaceSize(0, options)) {
+            canChoose = false;
+        } else {
+            workspace.data = options->workspace;
+            workspace.used = 0;
+            workspace.capacity = options->workspaceSize;
+            arena = &workspace;
+        }
+    }
+    SCRATCH_BUFFER(uint8_t, charModesBytes, charModesLength, arena);
+    uint8_t *charModes = segmented ? charModesBytes: NULL;
+    
+    uint8_t maxVersion = 0;
+    *versions = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        QRCodeBatchItem *item = &items[i];
+        
+        uint8_t version = item->version;
+        item->result = QRCODE_OK;
+        bits[i] = 0;
+        if (version > 40 || item->ecc > ECC_HIGH || eci >= 1000000) {
+            item->result = QRCODE_ERROR_INVALID_ARGUMENT;
+        } else if (version == 0 && !canChoose) {
+            item->result = QRCODE_ERROR_INVALID_ARGUMENT;
+        } else if (version == 0) {
+            if (!segmented || item->length <= maxLength) {
+                DataParts parts = { &item->data, &item->length, 1, item->length };
+                version = getMinimumVersion(item->ecc, &parts, kanji, getEciBits(eci), charModes, &bits[i]);
+            }
+            if (version == 0) { item->result = QRCODE_ERROR_DATA_TOO_LONG; }
+        }
+#if LOCK_VERSION != 0
+        if (item->result == QRCODE_OK) { version = LOCK_VERSION; }
+#endif
+        
+        item->qrcode.version = version;
+        
+        if (item->result != QRCODE_OK) { continue; }
+        *versions |= (uint64_t)1 << version;
+        if (version > maxVersion) { maxVersion = version; }
+    }
+    
+    return maxVersion;
+}
+
+struct BatchJob;
+
+// Each worker owns a range of items, which it encodes from the front; once empty, it steals
+// the back half of another worker's remaining range
+typedef struct BatchWorker {
+    pthread_mutex_t lock;
+    uint32_t next;
+    uint32_t end;
+    
+    struct BatchJob *job;
+    Arena arena;
+    uint32_t encoded;
+} BatchWorker;
+
+typedef struct BatchJob {
+    QRCodeBatchItem *items;
+    uint32_t *bits;                // The encoded length of each item, as resolved
+    const QRCodeOptions *options;
+    VersionTemplate templates[40];
+    BatchWorker *workers;
+    uint8_t workerCount;
+} BatchJob;
+
+static bool takeBatchItem(BatchWorker *worker, uint32_t *index) {
+    pthread_mutex_lock(&worker->lock);
+    bool found = (worker->next < worker->end);
+    if (found) { *index = worker->next++; }
+    pthread_mutex_unlock(&worker->lock);
+    return found;
+}
+
+// Only one lock is ever held at a time, so workers cannot deadlock
+static bool stealBatchItems(BatchWorker *thief) {
+    BatchJob *job = thief->job;
+    uint8_t thiefIndex = thief - job->workers;
+    
+    for (uint8_t i = 1; i < job->workerCount; i++) {
+        BatchWorker *victim = &job->workers[(thiefIndex + i) % job->workerCount];
+        
+        pthread_mutex_lock(&victim->lock);
+        uint32_t remaining = victim->end - victim->next;
+        uint32_t end = victim->end;
+        uint32_t start = end - (remaining + 1) / 2;
+        if (remaining > 0) { victim->end = start; }
+        pthread_mutex_unlock(&victim->lock);
+        
+        if (remaining > 0) {
+            pthread_mutex_lock(&thief->lock);
+            thief->next = start;
+            thief->end = end;
+            pthread_mutex_unlock(&thief->lock);
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+static void* runBatchWorker(void *arg) {
+    BatchWorker *worker = (BatchWorker*)arg;
+    BatchJob *job = worker->job;
+    
+    uint32_t index;
+    do {
+        while (takeBatchItem(worker, &index)) {
+            QRCodeBatchItem *item = &job->items[index];
+            if (item->result != QRCODE_OK) { continue; }
+            
+            uint8_t version = item->qrcode.version;
+            worker->arena.used = 0;
+            DataParts parts = { &item->data, &item->length, 1, item->length };
+            item->result = encodeSymbol(&item->qrcode, item->modules, version, job->bits[index], item->ecc, &parts, job->options, NULL, &job->templates[version - 1], &worker->arena);
+            if (item->result == QRCODE_OK) { worker->encoded++; }
+        }
+    } while (stealBatchItems(worker));
+    
+    return NULL;
+}
+
+uint32_t qrcode_initBatchThreaded(QRCodeBatchItem *items, uint32_t count, const QRCodeOptions *options, uint8_t threadCount) {
+    if (threadCount <= 1 || count <= 1) { return qrcode_initBatch(items, count, options); }
+    if (threadCount > count) { threadCount = count; }
+    
+    // The versions are resolved up front (to build their templates), and the encoded lengths
+    // kept so the workers need not find them again
+    BatchJob job;
+    job.bits = (uint32_t*)malloc((size_t)count * sizeof(uint32_t));
+    if (!job.bits) { return qrcode_initBatch(items, count, options); }
+    
+    uint64_t versions;
+    uint8_t maxVersion = resolveBatchVersions(items, count, options, &versions, job.bits);
+    if (maxVersion == 0) {
+        free(job.bits);
+        return 0;
+    }
+    
+    // The templates of every version used are shared (read-only) by all workers, and each
+    // worker gets its own scratch arena, large enough for any version in the batch
+    uint32_t templatesSize = 0;
+    for (uint8_t version = 1; version <= maxVersion; version++) {
+        if ((versions & ((uint64_t)1 << version)) == 0) { continue; }
+#if TEMPLATE_CACHE
+        // Fill the cache up front, so the workers never race to build it
+        const VersionTemplate *cached = getVersionTemplate(version);
+        if (cached) {
+            job.templates[version - 1] = *cached;
+            versions &= ~((uint64_t)1 << version);
+            continue;
+        }
+#endif
+        templatesSize += 10 * qrcode_getBufferSize(version);
+    }
+    uint32_t arenaSize = getScratchSize(maxVersion, options, true);
+    
+    uint8_t *templateBytes = (uint8_t*)malloc(templatesSize);
+    uint8_t *arenaBytes = (uint8_t*)malloc((size_t)threadCount * arenaSize);
+    job.workers = (BatchWorker*)malloc(threadCount * sizeof(BatchWorker));
+    pthread_t *threads = (pthread_t*)malloc(threadCount * sizeof(pthread_t));
+    bool *started = (bool*)malloc(threadCount * sizeof(bool));
+    
+    uint32_t encoded = 0;
+    if ((templateBytes || templatesSize == 0) && arenaBytes && job.workers && threads && started) {
+        job.items = items;
+        job.options = options;
+        job.workerCount = threadCount;
+        
+        // Build the templates which are not cached
+        uint8_t *templateData = templateBytes;
+        for (uint8_t version = 1; version <= maxVersion; version++) {
+            if ((versions & ((uint64_t)1 << version)) == 0) { continue; }
+            uint16_t gridBytes = qrcode_getBufferSize(version);
+            initVersionTemplate(&job.templates[version - 1], version, templateData, &templateData[gridBytes], &templateData[2 * gridBytes], NULL);
+            templateData += 10 * gridBytes;
+        }
+        
+        // Split the items evenly to start with
+        for (uint8_t i = 0; i < threadCount; i++) {
+            BatchWorker *worker = &job.workers[i];
+            pthread_mutex_init(&worker->lock, NULL);
+            worker->next = (uint64_t)count * i / threadCount;
+            worker->end = (uint64_t)count * (i + 1) / threadCount;
+            worker->job = &job;
+            worker->arena.data = &arenaBytes[(size_t)i * arenaSize];
+            worker->arena.used = 0;
+            worker->arena.capacity = arenaSize;
+            worker->encoded = 0;
+        }
+        
+        // The calling thread is worker 0; the range of any worker which fails to start is
+        // stolen by the others
+        for (uint8_t i = 1; i < threadCount; i++) {
+            started[i] = (pthread_create(&threads[i], NULL, runBatchWorker, &job.workers[i]) == 0);
+        }
+        runBatchWorker(&job.workers[0]);
+        
+        // Workers may steal from any other until they finish, so join them all first
+        for (uint8_t i = 1; i < threadCount; i++) {
+            if (started[i]) { pthread_join(threads[i], NULL); }
+        }
+        
+        for (uint8_t i = 0; i < threadCount; i++) {
+            pthread_mutex_destroy(&job.workers[i].lock);
+            encoded += job.workers[i].encoded;
+        }
+        
+    } else {
+        encoded = qrcode_initBatch(items, count, options);
+    }
+    
+    free(started);
+    free(threads);
+    free(job.workers);
+    free(arenaBytes);
+    free(templateBytes);
+    free(job.bits);
+    
+    return encoded;
+}
+
+#endif
+
+// Returns where part index of count evenly sized parts of the data ends, given where it starts.
+// If kanji is set, a cut which would split a double-byte character is moved after it (the data
+// is read from the start of the part, as Shift JIS cannot be read backwards).
+static uint32_t getPartEnd(const uint8_t *data, uint32_t length, uint8_t index, uint8_t count, bool kanji, uint32_t start) {
+    uint32_t end = length * (index + 1) / count;
+    if (!kanji) { return end; }
+    
+    uint32_t position = start;
+    while (position < end) {
+        position += (position + 1 < length && isKanjiPair(data[position], data[position + 1])) ? 2: 1;
+    }
+    return position;
+}
+
+uint8_t qrcode_planStructuredAppend(QRCodeBatchItem *items, uint8_t maxSymbols, uint8_t maxVersion, uint8_t ecc, const uint8_t *data, uint32_t length, const QRCodeOptions *options) {
+    uint32_t eci = (options ? options->eci: 0);
+    if (ecc > ECC_HIGH || eci >= 1000000) { return 0; }
+    if (maxSymbols > 16) { maxSymbols = 16; }
+    if (maxVersion == 0 || maxVersion > 40) { maxVersion = 40; }
+    
+    // Segmenting needs a mode per character, for the longest part which could fit
+    bool segmented = (options && options->optimizeSegments);
+    bool kanji = (options && options->kanji);
+    uint8_t headerBits = getEciBits(eci) + SEQUENCE_HEADER_BITS;
+    uint16_t maxLength = getMaxCharacters(LOCK_VERSION ? LOCK_VERSION: maxVersion);
+    
+    // Take them from the caller's workspace, if there is one (as large as maxVersion needs)
+    Arena workspace;
+    Arena *arena = NULL;
+    if (segmented && options->workspace) {
+        if (options->workspaceSize < qrcode_getWorkspaceSize(maxVersion, options)) { return 0; }
+        workspace.data = options->workspace;
+        workspace.used = 0;
+        workspace.capacity = options->workspaceSize;
+        arena = &workspace;
+    }
+    SCRATCH_BUFFER(uint8_t, charModesBytes, segmented ? maxLength: 1, arena);
+    uint8_t *charModes = segmented ? charModesBytes: NULL;
+    
+    // Try each number of (evenly sized) parts, keeping the one with the fewest modules
+    uint8_t bestCount = 0;
+    uint32_t bestModules = UINT32_MAX;
+    for (uint8_t count = 1; count <= maxSymbols; count++) {
+        if (length > (uint32_t)count * maxLength) { continue; }
+        
+        uint8_t versions[16];
+        uint32_t modules = 0;
+        uint32_t start = 0;
+        for (uint8_t i = 0; i < count && modules != UINT32_MAX; i++) {
+            uint32_t end = getPartEnd(data, length, i, count, kanji, start);
+            uint32_t bits;
+            versions[i] = 0;
+            if (end - start <= maxLength) {
+                const uint8_t *part = &data[start];
+                uint16_t partLength = end - start;
+                DataParts parts = { &part, &partLength, 1, partLength };
+                versions[i] = getMinimumVersion(ecc, &parts, kanji, headerBits, charModes, &bits);
+            }
+            
+            uint8_t size = versions[i] * 4 + 17;
+            modules = (versions[i] == 0 || versions[i] > maxVersion) ? UINT32_MAX: modules + size * size;
+            start = end;
+        }
+        if (modules >= bestModules) { continue; }
+        
+        bestCount = count;
+        bestModules = modules;
+        start = 0;
+        for (uint8_t i = 0; i < count; i++) {
+            uint32_t end = getPartEnd(data, length, i, count, kanji, start);
+            items[i].data = &data[start];
+            items[i].length = end - start;
+            items[i].version = versions[i];
+            items[i].ecc = ecc;
+            start = end;
+        }
+    }
+    
+    return bestCount;
+}
+
+typedef struct SequenceJob {
+    QRCodeBatchItem *items;
+    QRCodeOptions options;
+    Sequence sequence;
+} SequenceJob;
+
+static void encodeSequenceItem(void *arg, uint8_t index) {
+    SequenceJob *job = (SequenceJob*)arg;
+    QRCodeBatchItem *item = &job->items[index];
+    
+    Sequence sequence = job->sequence;
+    sequence.index = index;
+    DataParts parts = { &item->data, &item->length, 1, item->length };
+    item->result = encodeSymbol(&item->qrcode, item->modules, item->version, 0, item->ecc, &parts, &job->options, &sequence, NULL, NULL);
+}
+
+uint8_t qrcode_initStructuredAppend(QRCodeBatchItem *items, uint8_t count, const QRCodeOptions *options) {
+    if (count == 0 || count > 16) { return 0; }
+    
+    SequenceJob job;
+    job.items = items;
+    job.sequence.total = count;
+    job.sequence.parity = 0;
+    for (uint8_t i = 0; i < count; i++) {
+        for (uint16_t j = 0; j < items[i].length; j++) { job.sequence.parity ^= items[i].data[j]; }
+    }
+    
+    // The symbols (rather than their mask candidates) are spread over the executor
+    if (options) {
+        job.options = *options;
+    } else {
+        memset(&job.options, 0, sizeof(QRCodeOptions));
+    }
+    job.options.executor = NULL;
+    
+    // Concurrent symbols cannot share one workspace
+    if (options && options->executor) { job.options.workspace = NULL; }
+    
+    if (options && options->executor) {
+        options->executor(options->executorContext, encodeSequenceItem, &job, count);
+    } else {
+        for (uint8_t i = 0; i < count; i++) { encodeSequenceItem(&job, i); }
+    }
+    
+    uint8_t encoded = 0;
+    for (uint8_t i = 0; i < count; i++) {
+        if (items[i].result == QRCODE_OK) { encoded++; }
+    }
+    return encoded;
+}
+
+int8_t qrcode_initText(QRCode *qrcode, uint8_t *modules, uint8_t version, uint8_t ecc, const char *data) {
+    return qrcode_initBytes(qrcode, modules, version, ecc, (uint8_t*)data, strlen(data));
+}
+
+bool qrcode_getModule(QRCode *qrcode, uint8_t x, uint8_t y) {
+    if (x < 0 || x >= qrcode->size || y < 0 || y >= qrcode->size) {
+        return false;
+    }
+
+    uint32_t offset = y * qrcode->size + x;
+    return (qrcode->modules[offset >> 3] & (1 << (7 - (offset & 0x07)))) != 0;
+}
+
+uint32_t qrcode_getPenaltyScore(QRCode *qrcode, uint32_t limit) {
+    BitBucket modulesGrid;
+    modulesGrid.bitOffsetOrWidth = qrcode->size;
+    modulesGrid.capacityBytes = bb_getGridSizeBytes(qrcode->size);
+    modulesGrid.data = qrcode->modules;
+    
+    return getPenaltyScore(&modulesGrid, limit, NULL);
+}
+
+void qrcode_getRow(QRCode *qrcode, uint8_t y, uint8_t *row) {
+    uint8_t size = qrcode->size;
+    uint8_t length = (size + 7) / 8;
+    uint32_t offset = y * size;
+    
+    // Rows start at any bit, so each output byte straddles two bytes of the grid (the second
+    // of which is past the end of the buffer for the last byte of the last row)
+    const uint8_t *modules = &qrcode->modules[offset >> 3];
+    uint8_t shift = offset & 0x07;
+    uint16_t available = ((size * size + 7) >> 3) - (offset >> 3);
+    for (uint8_t i = 0; i < length; i++) {
+        uint8_t next = (i + 1 < available) ? modules[i + 1]: 0;
+        row[i] = (uint8_t)((modules[i] << shift) | (shift ? (next >> (8 - shift)): 0));
+    }
+    
+    if (size & 0x07) { row[length - 1] &= (uint8_t)(0xff << (8 - (size & 0x07))); }
+}
+
+void qrcode_getRowBytes(QRCode *qrcode, uint8_t y, uint8_t *row) {
+    uint8_t size = qrcode->size;
+    uint32_t offset = y * size;
+    
+    const uint8_t *modules = &qrcode->modules[offset >> 3];
+    uint8_t bits = *modules++ << (offset & 0x07), remaining = 8 - (offset & 0x07);
+    for (uint8_t x = 0; x < size; x++) {
+        if (remaining == 0) {
+            bits = *modules++;
+            remaining = 8;
+        }
+        row[x] = bits >> 7;
+        bits <<= 1;
+        remaining--;
+    }
+}
+
+void qrcode_getScanline(QRCode *qrcode, int16_t y, uint8_t scale, uint8_t border, uint8_t dark, uint8_t light, uint8_t *scanline) {
+    uint8_t size = qrcode->size;
+    
+    if (y < 0 || y >= size) {
+        memset(scanline, light, (uint32_t)(size + 2 * border) * scale);
+        return;
+    }
+    
+    uint32_t quiet = (uint32_t)border * scale;
+    memset(scanline, light, quiet);
+    scanline += quiet;
+    
+    uint8_t row[(177 + 7) / 8];
+    qrcode_getRow(qrcode, y, row);
+    for (uint8_t x = 0; x < size; x++) {
+        memset(scanline, (row[x >> 3] & (0x80 >> (x & 0x07))) ? dark: light, scale);
+        scanline += scale;
+    }
+    
+    memset(scanline, light, quiet);
+}
+
+void qrcode_getRows(QRCode *qrcode, uint8_t *rows, uint16_t stride) {
+    for (uint8_t y = 0; y < qrcode->size; y++) {
+        qrcode_getRow(qrcode, y, &rows[y * stride]);
+    }
+}
+
+uint32_t qrcode_getRasterLineSize(QRCode *qrcode, uint8_t scale, uint8_t border) {
+    return ((uint32_t)(qrcode->size + 2 * border) * scale + 7) / 8;
+}
+
+void qrcode_getRasterLine(QRCode *qrcode, int16_t y, uint8_t scale, uint8_t border, uint8_t *line) {
+    uint8_t row[(177 + 7) / 8];
+    bool inside = (y >= 0 && y < qrcode->size);
+    if (inside) { qrcode_getRow(qrcode, y, row); }
+    
+    uint32_t length = qrcode_getRasterLineSize(qrcode, scale, border);
+    for (uint32_t start = 0; start < length; start += 0xffff) {
+        uint16_t count = (length - start < 0xffff) ? (length - start): 0xffff;
+        fillRasterLine(inside ? row: NULL, qrcode->size, scale, border, start, &line[start], count);
+    }
+}
+
+int8_t qrcode_writePbm(QRCode *qrcode, uint8_t scale, uint8_t border, QRCodeWriter writer, void *context) {
+    if (scale == 0) { return QRCODE_ERROR_INVALID_ARGUMENT; }
+    
+    uint32_t width = (uint32_t)(qrcode->size + 2 * border) * scale;
+    
+    // A binary (P4) portable bitmap: the header, then each row of pixels (1 for black)
+    char header[32] = "P4\n";
+    char *end = appendDecimal(&header[3], width);
+    *end++ = ' ';
+    end = appendDecimal(end, width);
+    *end++ = '\n';
+    if (!writer(context, (const uint8_t*)header, end - header)) { return QRCODE_ERROR_WRITE_FAILED; }
+    
+    return writeRaster(qrcode, scale, border, qrcode_getRasterLineSize(qrcode, scale, border), false, writer, context);
+}
+
+int8_t qrcode_writePng(QRCode *qrcode, uint8_t scale, uint8_t border, QRCodeWriter writer, void *context) {
+    if (scale == 0) { return QRCODE_ERROR_INVALID_ARGUMENT; }
+    
+    uint8_t size = qrcode->size;
+    uint16_t height = size + 2 * border;
+    uint32_t width = (uint32_t)height * scale;
+    uint32_t stride = qrcode_getRasterLineSize(qrcode, scale, border);
+    
+    PngWriter png;
+    memset(&png, 0, sizeof(PngWriter));
+    png.writer = writer;
+    png.context = context;
+    png.adlerA = 1;
+    png.literal = -1;
+    
+    // The signature, and a header for 1-bit grayscale without interlacing
+    static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    if (!writer(context, signature, sizeof(signature))) { return QRCODE_ERROR_WRITE_FAILED; }
+    
+    uint8_t header[8 + 13 + 4];
+    putBigEndian(&header[8], width, 4);
+    putBigEndian(&header[12], width, 4);
+    header[16] = 1;
+    header[17] = header[18] = header[19] = header[20] = 0;
+    png_writeChunk(&png, "IHDR", header, 13);
+    
+    // The zlib header (deflate with a 32KB window), and a final block of fixed Huffman codes
+    png_appendByte(&png, 0x78);
+    png_appendByte(&png, 0x01);
+    png_appendBits(&png, 0x03, 3);
+    
+    // Each scanline is a filter type (0, none) and the pixels, in which 0 is black. Every
+    // scanline after the first of a row of modules, or repeating the row before, is sent as
+    // a copy of the previous one.
+    uint8_t row[(177 + 7) / 8], previous[(177 + 7) / 8];
+    bool previousInside = false;
+    uint8_t chunk[RASTER_CHUNK_BYTES];
+    
+    for (uint16_t i = 0; i < height && !png.failed; i++) {
+        int16_t y = i - border;
+        bool inside = (y >= 0 && y < size);
+        if (inside) { qrcode_getRow(qrcode, y, row); }
+        bool same = (i > 0 && inside == previousInside && (!inside || memcmp(row, previous, (size + 7) / 8) == 0));
+        
+        for (uint8_t repeat = 0; repeat < scale; repeat++) {
+            static const uint8_t filter = 0;
+            if (repeat == 0 && !same) {
+                png_compress(&png, &filter, 1);
+            } else {
+                png_addAdler(&png, &filter, 1);
+            }
+            
+            for (uint32_t start = 0; start < stride; start += RASTER_CHUNK_BYTES) {
+                uint16_t count = (stride - start < RASTER_CHUNK_BYTES) ? (stride - start): RASTER_CHUNK_BYTES;
+                if (repeat == 0 || stride > RASTER_CHUNK_BYTES) {
+                    fillRasterLine(inside ? row: NULL, size, scale, border, start, chunk, count);
+                    for (uint16_t j = 0; j < count; j++) { chunk[j] = ~chunk[j]; }
+                }
+                
+                // The Adler-32 sums still cover the copied bytes
+                if (repeat == 0 && !same) {
+                    png_compress(&png, chunk, count);
+                } else {
+                    png_addAdler(&png, chunk, count);
+                }
+            }
+            
+            if (repeat > 0 || same) { png_compressRepeat(&png, 1 + stride); }
+        }
+        
+        memcpy(previous, row, sizeof(row));
+        previousInside = inside;
+    }
+    
+    // The end of the block, padded to a byte, and the Adler-32 checksum
+    png_flushRepeats(&png);
+    png_appendSymbol(&png, 256);
+    png_appendBits(&png, 0, (8 - png.bitCount) & 0x07);
+    uint8_t adler[4];
+    putBigEndian(adler, (png.adlerB << 16) | png.adlerA, 4);
+    for (uint8_t i = 0; i < 4; i++) { png_appendByte(&png, adler[i]); }
+    if (png.length) { png_writeChunk(&png, "IDAT", png.chunk, png.length); }
+    
+    uint8_t end[8 + 4];
+    png_writeChunk(&png, "IEND", end, 0);
+    
+    return png.failed ? QRCODE_ERROR_WRITE_FAILED: QRCODE_OK;
+}
+
+uint32_t qrcode_getSvg(QRCode *qrcode, uint8_t border, char *buffer, uint32_t bufferSize) {
+    TextOutput output;
+    text_init(&output, buffer, bufferSize, NULL, NULL);
+    appendSvg(qrcode, border, &output);
+    return text_finish(&output);
+}
+
+int8_t qrcode_writeSvg(QRCode *qrcode, uint8_t border, QRCodeWriter writer, void *context) {
+    TextOutput output;
+    text_init(&output, NULL, 0, writer, context);
+    appendSvg(qrcode, border, &output);
+    text_finish(&output);
+    return output.failed ? QRCODE_ERROR_WRITE_FAILED: QRCODE_OK;
+}
+
+uint32_t qrcode_getPdfContent(QRCode *qrcode, uint8_t border, char *buffer, uint32_t bufferSize) {
+    TextOutput output;
+    text_init(&output, buffer, bufferSize, NULL, NULL);
+    appendPdfContent(qrcode, border, &output);
+    return text_finish(&output);
+}
+
+int8_t qrcode_writePdfContent(QRCode *qrcode, uint8_t border, QRCodeWriter writer, void *context) {
+    TextOutput output;
+    text_init(&output, NULL, 0, writer, context);
+    appendPdfContent(qrcode, border, &output);
+    text_finish(&output);
+    return output.failed ? QRCODE_ERROR_WRITE_FAILED: QRCODE_OK;
+}
+
+uint16_t qrcode_getTextLineSize(QRCode *qrcode, uint8_t border) {
+    return (qrcode->size + 2 * border) * 3 + 2;
+}
+
+uint16_t qrcode_getTextLine(QRCode *qrcode, uint16_t line, uint8_t border, uint8_t style, char *buffer) {
+    TextOutput output;
+    text_init(&output, buffer, qrcode_getTextLineSize(qrcode, border), NULL, NULL);
+    appendTextLine(qrcode, line, border, style, &output);
+    return text_finish(&output);
+}
+
+int8_t qrcode_writeText(QRCode *qrcode, uint8_t border, uint8_t style, QRCodeWriter writer, void *context) {
+    TextOutput output;
+    text_init(&output, NULL, 0, writer, context);
+    
+    uint16_t lines = (qrcode->size + 2 * border + 1) / 2;
+    for (uint16_t line = 0; line < lines && !output.failed; line++) {
+        appendTextLine(qrcode, line, border, style, &output);
+    }
+    
+    text_finish(&output);
+    return output.failed ? QRCODE_ERROR_WRITE_FAILED: QRCODE_OK;
+}
+
+int8_t qrcode_writeBmp(QRCode *qrcode, uint8_t scale, uint8_t border, QRCodeWriter writer, void *context) {
+    if (scale == 0) { return QRCODE_ERROR_INVALID_ARGUMENT; }
+    
+    uint32_t width = (uint32_t)(qrcode->size + 2 * border) * scale;
+    uint32_t stride = (width + 31) / 32 * 4;
+    
+    // A file header, an info header and a 2 color palette (white, then black, so a 1 bit
+    // is dark), followed by the rows of pixels (padded to 4 bytes) from the bottom up
+    uint8_t header[62];
+    memset(header, 0, sizeof(header));
+    header[0] = 'B';
+    header[1] = 'M';
+    putLittleEndian(&header[2], sizeof(header) + stride * width, 4);
+    putLittleEndian(&header[10], sizeof(header), 4);
+    putLittleEndian(&header[14], 40, 4);
+    putLittleEndian(&header[18], width, 4);
+    putLittleEndian(&header[22], width, 4);
+    putLittleEndian(&header[26], 1, 2);
+    putLittleEndian(&header[28], 1, 2);
+    putLittleEndian(&header[34], stride * width, 4);
+    putLittleEndian(&header[38], 2835, 4);
+    putLittleEndian(&header[42], 2835, 4);
+    putLittleEndian(&header[46], 2, 4);
+    memset(&header[54], 0xff, 3);
+    if (!writer(context, header, sizeof(header))) { return QRCODE_ERROR_WRITE_FAILED; }
+    
+    return writeRaster(qrcode, scale, border, stride, true, writer, context);
 }
 
 /*
@@ -46,6 +46,7 @@ static const bool true = 1;
 #define MODE_NUMERIC        0
 #define MODE_ALPHANUMERIC   1
 #define MODE_BYTE           2
+#define MODE_KANJI          3
 
 
 // Error Correction Code Levels
@@ -55,6 +56,32 @@ static const bool true = 1;
 #define ECC_HIGH           3
 
 
+// Results of the qrcode_init functions
+#define QRCODE_OK                        0
+#define QRCODE_ERROR_DATA_TOO_LONG      -1
+#define QRCODE_ERROR_INVALID_ARGUMENT   -2
+#define QRCODE_ERROR_WRITE_FAILED       -3
+
+
+// How QRCodeOptions.maskPolicy chooses the mask; any mask gives a valid symbol, but the
+// best (by the standard's penalty rules) is the easiest to scan
+#define MASK_BEST          0     // Score all 8 masks (the default)
+#define MASK_FAST          1     // Score only 4 masks, for half the work
+#define MASK_FIXED         2     // Use QRCodeOptions.fixedMask, without scoring
+
+
+// How qrcode_getTextLine draws modules; TEXT_INVERTED may be combined with either
+#define TEXT_HALF_BLOCKS   0     // UTF-8 half blocks, two rows of modules per line
+#define TEXT_ASCII         1     // ASCII instead: '"' for the top, ',' the bottom, '#' both
+#define TEXT_INVERTED      2     // Draw light modules instead, for dark backgrounds
+
+
+// Common ECI assignment numbers (character sets) for QRCodeOptions.eci
+#define ECI_ISO_8859_1     3
+#define ECI_SHIFT_JIS      20
+#define ECI_UTF8           26
+
+
 // If set to non-zero, this library can ONLY produce QR codes at that version
 // This saves a lot of dynamic memory, as the codeword tables are skipped
 #ifndef LOCK_VERSION
@@ -62,16 +89,160 @@ static const bool true = 1;
 #endif
 
 
+// If set to non-zero, the lookup tables and caches below default to off, trading
+// encoding speed for memory. This is the default on AVR, where constant tables are
+// copied into (very limited) RAM.
+#ifndef LOW_MEMORY
+#ifdef __AVR__
+#define LOW_MEMORY         1
+#else
+#define LOW_MEMORY         0
+#endif
+#endif
+
+// If set to non-zero, Reed-Solomon arithmetic uses GF(256) log/antilog tables
+// (768 bytes) instead of bit-serial multiplication, and the generator polynomials
+// for every block length are precomputed (246 bytes) instead of built per call
+#ifndef RS_LOOKUP_TABLES
+#define RS_LOOKUP_TABLES   (!LOW_MEMORY)
+#endif
+
+// If set to non-zero, each mask pattern is rendered into a scratch grid (on the stack,
+// the same size as the modules buffer) and applied a word at a time
+#ifndef FAST_MASKING
+#define FAST_MASKING       (!LOW_MEMORY)
+#endif
+
+// If set to non-zero, the mask penalty is computed on 64-bit words, 64 rows or columns
+// at a time, using up to 4.5KB of stack
+#ifndef FAST_PENALTY
+#define FAST_PENALTY       (!LOW_MEMORY)
+#endif
+
+// If set to non-zero, the function patterns (and mask grids, with FAST_MASKING) of each
+// version are built once and copied into every symbol, rather than redrawn, along with a
+// map of where each data bit is placed. They are kept on the heap (up to 100KB per version
+// used), or compiled in for LOCK_VERSION.
+#ifndef TEMPLATE_CACHE
+#define TEMPLATE_CACHE     (!LOW_MEMORY)
+#endif
+
+// If set to non-zero, characters are classified (and alphanumeric values looked up) through
+// a 256-byte table, and checked 16 at a time with SSE2 or NEON where available
+#ifndef FAST_CLASSIFY
+#define FAST_CLASSIFY      (!LOW_MEMORY)
+#endif
+
+// If set to non-zero, helpers that run work on POSIX threads are included (link with -pthread)
+#ifndef USE_PTHREADS
+#define USE_PTHREADS       0
+#endif
+
+// The number of threads (including the calling one) qrcode_threadExecutor runs tasks on; the
+// others are started on its first call and kept for later ones. Below 2, tasks run inline.
+#ifndef THREAD_POOL_SIZE
+#define THREAD_POOL_SIZE   4
+#endif
+
+// The most pieces a QRCodeStream can be fed (each takes a pointer and length in the stream)
+#ifndef STREAM_MAX_PIECES
+#define STREAM_MAX_PIECES  8
+#endif
+
+
 typedef struct QRCode {
     uint8_t version;
     uint8_t size;
     uint8_t ecc;
-    uint8_t mode;
+    uint8_t mode;          // The mode of the first segment
     uint8_t mask;
     uint8_t *modules;
 } QRCode;
 
 
+// Runs task(arg, index) for every index in [0, count), possibly concurrently, and
+// returns once all of them have completed
+typedef void (*QRCodeExecutor)(void *context, void (*task)(void *arg, uint8_t index), void *arg, uint8_t count);
+
+// Receives each piece of output from the image writers (e.g. qrcode_writeBmp), in order;
+// returns false to stop writing
+typedef bool (*QRCodeWriter)(void *context, const uint8_t *data, uint32_t length);
+
+// Optional parameters for qrcode_initBytesWithOptions; zero-initialize for the defaults
+typedef struct QRCodeOptions {
+    // If set, each of the 8 mask candidates is rendered into its own scratch grid (on the
+    // stack, 8 times the modules buffer) and scored through this executor, rather than
+    // serially in place. The result is identical either way.
+    QRCodeExecutor executor;
+    void *executorContext;
+    
+    // If set, the error correction level is raised as far as possible without needing a
+    // larger version; the level used is reported in QRCode.ecc
+    bool boostEcc;
+    
+    // If set, the data is split into numeric, alphanumeric and byte segments wherever that
+    // makes it shorter (e.g. a URL ending in a long number), rather than encoded in a single
+    // mode. This takes a scratch byte per character (on the stack).
+    bool optimizeSegments;
+    
+    // If set, the data is taken to be Shift JIS, so double-byte characters in the Kanji ranges
+    // may be encoded in Kanji mode (13 bits each, rather than 16 in byte mode). This is off by
+    // default, as other encodings (such as UTF-8) can contain the same byte pairs.
+    bool kanji;
+    
+    // If non-zero, the data is preceded by an ECI header declaring its character set (e.g.
+    // ECI_UTF8), which scanners otherwise have to guess for byte mode. The header takes 12
+    // to 28 bits, counted against the capacity; values of 1000000 or more are invalid.
+    uint32_t eci;
+    
+    // If non-NULL, the scratch buffers of an encode (about 20KB for version 40) are taken from
+    // this memory of workspaceSize bytes, which must be at least qrcode_getWorkspaceSize, rather
+    // than the stack. It may be reused by one encode after another, but not by several at once.
+    // While segmenting, choosing the versions of a batch or a Structured Append plan takes the
+    // character modes from it too, so it must then be large enough for any version they may
+    // choose (version 0, or maxVersion); batch items of version 0 otherwise fail with
+    // QRCODE_ERROR_INVALID_ARGUMENT.
+    uint8_t *workspace;
+    uint32_t workspaceSize;
+    
+    // How the mask is chosen (see MASK_BEST), and the mask (0 to 7) used with MASK_FIXED;
+    // the mask chosen is reported in QRCode.mask
+    uint8_t maskPolicy;
+    uint8_t fixedMask;
+} QRCodeOptions;
+
+
+// A single symbol of a batch (see qrcode_initBatch)
+typedef struct QRCodeBatchItem {
+    // Input
+    const uint8_t *data;
+    uint16_t length;
+    uint8_t version;       // 0 selects the smallest version that fits
+    uint8_t ecc;
+    uint8_t *modules;      // qrcode_getBufferSize(version) bytes; for version 0, enough for any version it may need
+    
+    // Output
+    QRCode qrcode;
+    int8_t result;         // QRCODE_OK or an error, as returned by qrcode_initBytes
+} QRCodeBatchItem;
+
+
+// An encoding in progress, for data which arrives in pieces (see qrcode_beginStream); the
+// fields are private
+typedef struct QRCodeStream {
+    QRCode *qrcode;
+    uint8_t *modules;
+    const QRCodeOptions *options;
+    const uint8_t *pieces[STREAM_MAX_PIECES];
+    uint16_t lengths[STREAM_MAX_PIECES];
+    uint16_t length;
+    uint8_t count;
+    uint8_t version;
+    uint8_t ecc;
+    int8_t result;
+} QRCodeStream;
+
+
 #ifdef __cplusplus
 extern "C"{
 #endif  /* __cplusplus */
@@ -80,11 +251,140 @@ extern "C"{
 
 uint16_t qrcode_getBufferSize(uint8_t version);
 
+// Returns the size of QRCodeOptions.workspace needed for encodes of up to the version (0 for
+// any) with the other options given
+uint32_t qrcode_getWorkspaceSize(uint8_t version, const QRCodeOptions *options);
+
+// Returns the smallest version the data fits in at the given error correction level, or 0
+// if it is too long for any version. With optimizeSegments or kanji, the version used may be smaller;
+// with an ECI header it may be one larger.
+uint8_t qrcode_getMinimumVersion(uint8_t ecc, const uint8_t *data, uint16_t length);
+
+// A version of 0 selects the smallest version the data fits in (see qrcode_getMinimumVersion);
+// modules must then be large enough for that version. Returns QRCODE_OK, or
+// QRCODE_ERROR_DATA_TOO_LONG if the data does not fit.
 int8_t qrcode_initText(QRCode *qrcode, uint8_t *modules, uint8_t version, uint8_t ecc, const char *data);
 int8_t qrcode_initBytes(QRCode *qrcode, uint8_t *modules, uint8_t version, uint8_t ecc, uint8_t *data, uint16_t length);
+int8_t qrcode_initBytesWithOptions(QRCode *qrcode, uint8_t *modules, uint8_t version, uint8_t ecc, const uint8_t *data, uint16_t length, const QRCodeOptions *options);
+
+// Encodes the data in count parts (e.g. a header and body in separate buffers) exactly as
+// qrcode_initBytesWithOptions would the parts joined together, reading each where it is
+// rather than copying them together first
+int8_t qrcode_initPartsWithOptions(QRCode *qrcode, uint8_t *modules, uint8_t version, uint8_t ecc, const uint8_t *const *parts, const uint16_t *lengths, uint8_t count, const QRCodeOptions *options);
+
+// Encodes data which arrives in pieces, as qrcode_initPartsWithOptions: each piece passed to
+// qrcode_feedStream (up to STREAM_MAX_PIECES) is only noted, and must remain valid, along with
+// options, until qrcode_finishStream encodes them all. Feeding more pieces fails with
+// QRCODE_ERROR_INVALID_ARGUMENT. Each returns QRCODE_OK or the first error encountered.
+int8_t qrcode_beginStream(QRCodeStream *stream, QRCode *qrcode, uint8_t *modules, uint8_t version, uint8_t ecc, const QRCodeOptions *options);
+int8_t qrcode_feedStream(QRCodeStream *stream, const uint8_t *data, uint16_t length);
+int8_t qrcode_finishStream(QRCodeStream *stream);
+
+// Encodes many symbols, as qrcode_initBytesWithOptions would each item in turn. With
+// TEMPLATE_CACHE, the function patterns (and mask patterns) of each version are drawn only
+// once for the whole batch; without it (as with LOW_MEMORY), batching saves nothing over
+// encoding the items one by one. Options (which may be NULL) apply to every item. Returns the
+// number of items successfully encoded.
+uint32_t qrcode_initBatch(QRCodeBatchItem *items, uint32_t count, const QRCodeOptions *options);
+
+// Splits data too long for one symbol (or which would need a large, slow version) into a
+// Structured Append sequence of up to maxSymbols (at most 16), of versions up to maxVersion
+// (0 for any). The number of symbols is chosen to minimize the total number of modules, and
+// the data, length, version and ecc of each are filled into items (which must have room for
+// maxSymbols); the modules of each must then be set to qrcode_getBufferSize(version) bytes.
+// With kanji set, the data is only cut between Shift JIS double-byte characters.
+// Returns the number of symbols, or 0 if the data does not fit (or, while segmenting, the
+// workspace is smaller than qrcode_getWorkspaceSize(maxVersion, options)).
+uint8_t qrcode_planStructuredAppend(QRCodeBatchItem *items, uint8_t maxSymbols, uint8_t maxVersion, uint8_t ecc, const uint8_t *data, uint32_t length, const QRCodeOptions *options);
+
+// Encodes the items (in order) as a Structured Append sequence, each tagged with its position
+// and the parity of all of their data. With an executor, the symbols are encoded concurrently
+// through it (each scoring its mask candidates serially). Returns the number encoded.
+uint8_t qrcode_initStructuredAppend(QRCodeBatchItem *items, uint8_t count, const QRCodeOptions *options);
 
 bool qrcode_getModule(QRCode *qrcode, uint8_t x, uint8_t y);
 
+// Returns the mask penalty score of the modules, as used to choose the mask. Scoring stops
+// once the score reaches limit, returning a score of at least limit; pass UINT32_MAX for
+// the exact score.
+uint32_t qrcode_getPenaltyScore(QRCode *qrcode, uint32_t limit);
+
+// These read a whole row of modules at a time, for rendering, rather than looking up each
+// with qrcode_getModule. qrcode_getRow copies row y as bits (most significant first, 1 for
+// dark) into (size + 7) / 8 bytes, clearing the unused bits of the last; qrcode_getRowBytes
+// copies it into size bytes, 1 for dark and 0 for light.
+void qrcode_getRow(QRCode *qrcode, uint8_t y, uint8_t *row);
+void qrcode_getRowBytes(QRCode *qrcode, uint8_t y, uint8_t *row);
+
+// Fills (size + 2 * border) * scale bytes of scanline with row y (-border to size + border - 1,
+// where the rows outside the symbol are the quiet zone), each module repeated scale times
+// as the dark or light value (e.g. 0x00 and 0xff for 8-bit grayscale)
+void qrcode_getScanline(QRCode *qrcode, int16_t y, uint8_t scale, uint8_t border, uint8_t dark, uint8_t light, uint8_t *scanline);
+
+// Copies every row (as qrcode_getRow) into rows, stride bytes apart (at least (size + 7) / 8)
+void qrcode_getRows(QRCode *qrcode, uint8_t *rows, uint16_t stride);
+
+// Fills qrcode_getRasterLineSize bytes of line with the 1-bit scanline (most significant bit
+// first, 1 for dark, as printers take it) of row y (as qrcode_getScanline), each module scale
+// pixels wide; the unused bits of the last byte are cleared
+uint32_t qrcode_getRasterLineSize(QRCode *qrcode, uint8_t scale, uint8_t border);
+void qrcode_getRasterLine(QRCode *qrcode, int16_t y, uint8_t scale, uint8_t border, uint8_t *line);
+
+// Write the symbol as a binary PBM (P4) or monochrome BMP image, each module scale pixels
+// square with a quiet zone of border modules, through the writer a piece at a time (at most
+// 64 bytes of pixels), without buffering the image. Each returns QRCODE_OK,
+// QRCODE_ERROR_WRITE_FAILED if the writer returned false, or QRCODE_ERROR_INVALID_ARGUMENT
+// for a scale of 0.
+int8_t qrcode_writePbm(QRCode *qrcode, uint8_t scale, uint8_t border, QRCodeWriter writer, void *context);
+int8_t qrcode_writeBmp(QRCode *qrcode, uint8_t scale, uint8_t border, QRCodeWriter writer, void *context);
+
+// Writes the symbol as a 1-bit grayscale PNG (as qrcode_writeBmp), compressed without a
+// general-purpose deflate: runs of repeated pixel bytes, and scanlines repeating the one
+// before, are sent as copies (e.g. about 600 bytes for version 1 at 4 pixels per module).
+// Returns as qrcode_writeBmp does.
+int8_t qrcode_writePng(QRCode *qrcode, uint8_t scale, uint8_t border, QRCodeWriter writer, void *context);
+
+// Produce the symbol as an SVG (with a unit per module, including a quiet zone of border
+// modules) or a PDF content stream (filling the dark modules, with a unit per module and
+// the origin at the bottom left of the quiet zone; scale it with the cm operator). Each run
+// of dark modules in a row is a single rectangle. qrcode_getSvg and qrcode_getPdfContent
+// copy it into buffer as snprintf does, returning its length (without the terminator,
+// whether or not it fit), so a NULL buffer of size 0 gives the size up front;
+// qrcode_writeSvg and qrcode_writePdfContent send it through the writer, returning as
+// qrcode_writeBmp does.
+uint32_t qrcode_getSvg(QRCode *qrcode, uint8_t border, char *buffer, uint32_t bufferSize);
+int8_t qrcode_writeSvg(QRCode *qrcode, uint8_t border, QRCodeWriter writer, void *context);
+uint32_t qrcode_getPdfContent(QRCode *qrcode, uint8_t border, char *buffer, uint32_t bufferSize);
+int8_t qrcode_writePdfContent(QRCode *qrcode, uint8_t border, QRCodeWriter writer, void *context);
+
+// Draw the symbol as text, for a console or serial monitor: each line holds two rows of
+// modules, each character being a module wide (so about square in a monospace font). Line
+// 0 to (size + 2 * border + 1) / 2 - 1 (including a quiet zone of border modules, and light
+// below the last row) is copied into buffer, which must hold qrcode_getTextLineSize bytes,
+// ending in a newline and then a terminator; its length (without the terminator) is
+// returned. qrcode_writeText sends every line through the writer, returning as
+// qrcode_writeBmp does.
+uint16_t qrcode_getTextLineSize(QRCode *qrcode, uint8_t border);
+uint16_t qrcode_getTextLine(QRCode *qrcode, uint16_t line, uint8_t border, uint8_t style, char *buffer);
+int8_t qrcode_writeText(QRCode *qrcode, uint8_t border, uint8_t style, QRCodeWriter writer, void *context);
+
+// Reports how many error correction generator polynomials were served from the
+// precomputed table (hits) versus built at encode time (misses)
+void qrcode_getGeneratorStats(uint32_t *hits, uint32_t *misses);
+
+#if USE_PTHREADS
+// A QRCodeExecutor which runs the tasks on a pool of THREAD_POOL_SIZE threads (including the
+// calling one), each taking the next task as it finishes one; context is unused. The pool
+// runs one call at a time, so a call made while it is busy runs its tasks inline.
+void qrcode_threadExecutor(void *context, void (*task)(void *arg, uint8_t index), void *arg, uint8_t count);
+
+// Same as qrcode_initBatch, but spread over threadCount threads (including the calling one),
+// which steal work from each other as they run out, so a few large symbols do not hold up
+// the rest. Scratch memory comes from per-thread heap arenas rather than the thread stacks.
+// The output is identical to qrcode_initBatch.
+uint32_t qrcode_initBatchThreaded(QRCodeBatchItem *items, uint32_t count, const QRCodeOptions *options, uint8_t threadCount);
+#endif
+
 
 
 #ifdef __cplusplus
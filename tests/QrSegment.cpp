@@ -47,6 +47,8 @@ const qrcodegen::QrSegment::Mode qrcodegen::QrSegment::Mode::NUMERIC     (0x1, 1
 const qrcodegen::QrSegment::Mode qrcodegen::QrSegment::Mode::ALPHANUMERIC(0x2,  9, 11, 13);
 const qrcodegen::QrSegment::Mode qrcodegen::QrSegment::Mode::BYTE        (0x4,  8, 16, 16);
 const qrcodegen::QrSegment::Mode qrcodegen::QrSegment::Mode::KANJI       (0x8,  8, 10, 12);
+const qrcodegen::QrSegment::Mode qrcodegen::QrSegment::Mode::ECI         (0x7,  0,  0,  0);
+const qrcodegen::QrSegment::Mode qrcodegen::QrSegment::Mode::STRUCTURED_APPEND(0x3, 0, 0, 0);
 
 
 
@@ -101,6 +103,24 @@ qrcodegen::QrSegment qrcodegen::QrSegment::makeAlphanumeric(const char *text) {
 }
 
 
+qrcodegen::QrSegment qrcodegen::QrSegment::makeEci(long assignVal) {
+	BitBuffer bb;
+	if (assignVal < 0)
+		throw "ECI assignment value out of range";
+	else if (assignVal < (1 << 7))
+		bb.appendBits(assignVal, 8);
+	else if (assignVal < (1 << 14)) {
+		bb.appendBits(2, 2);
+		bb.appendBits(assignVal, 14);
+	} else if (assignVal < 1000000L) {
+		bb.appendBits(6, 3);
+		bb.appendBits(assignVal, 21);
+	} else
+		throw "ECI assignment value out of range";
+	return QrSegment(Mode::ECI, 0, bb.getBytes(), bb.getBitLength());
+}
+
+
 std::vector<qrcodegen::QrSegment> qrcodegen::QrSegment::makeSegments(const char *text) {
 	// Select the most efficient segment encoding automatically
 	std::vector<QrSegment> result;
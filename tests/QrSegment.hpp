@@ -55,6 +55,8 @@ public:
 		static const Mode ALPHANUMERIC;
 		static const Mode BYTE;
 		static const Mode KANJI;
+		static const Mode ECI;
+		static const Mode STRUCTURED_APPEND;
 		
 		
 		/*-- Fields --*/
@@ -107,6 +109,13 @@ public:
 	static QrSegment makeAlphanumeric(const char *text);
 	
 	
+	/* 
+	 * Returns a segment representing an Extended Channel Interpretation
+	 * (ECI) designator with the given assignment value.
+	 */
+	static QrSegment makeEci(long assignVal);
+	
+	
 	/* 
 	 * Returns a list of zero or more segments to represent the given text string.
 	 * The result may use various segment modes and switch modes to optimize the length of the bit stream.
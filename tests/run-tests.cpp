@@ -1,12 +1,48 @@
+#include <algorithm>
+#include <ctime>
+#include <cstring>
 #include <iostream>
 #include <string>
+#include <vector>
 
 #include "../src/qrcode.h"
+#include "BitBuffer.hpp"
 #include "QrCode.hpp"
 
-static uint32_t check(const qrcodegen::QrCode &nayuki, QRCode *ricmoo) {
+// Checks the row exports against qrcode_getModule, returning the number of modules which differ
+static uint32_t checkRows(QRCode *qrcode) {
     uint32_t wrong = 0;
 
+    int size = qrcode->size, border = 2, scale = 3, stride = (size + 7) / 8 + 1;
+    std::vector<uint8_t> rows(size * stride, 0xAA), bytes(size), scanline((size + 2 * border) * scale + 1, 0xAA);
+    qrcode_getRows(qrcode, &rows[0], stride);
+
+    for (int y = -border; y < size + border; y++) {
+        qrcode_getScanline(qrcode, y, scale, border, 'X', '.', &scanline[0]);
+        if (scanline.back() != 0xAA) { wrong++; }
+        for (int x = -border; x < size + border; x++) {
+            for (int i = 0; i < scale; i++) {
+                if ((scanline[(x + border) * scale + i] == 'X') != qrcode_getModule(qrcode, x, y)) { wrong++; }
+            }
+        }
+        if (y < 0 || y >= size) { continue; }
+
+        const uint8_t *row = &rows[y * stride];
+        qrcode_getRowBytes(qrcode, y, &bytes[0]);
+        for (int x = 0; x < stride * 8; x++) {
+            bool module = qrcode_getModule(qrcode, x, y);
+            if (x < size && bytes[x] != module) { wrong++; }
+            if (x < (size + 7) / 8 * 8 && !!(row[x >> 3] & (0x80 >> (x & 7))) != module) { wrong++; }
+        }
+        if (row[stride - 1] != 0xAA) { wrong++; }
+    }
+
+    return wrong;
+}
+
+static uint32_t check(const qrcodegen::QrCode &nayuki, QRCode *ricmoo) {
+    uint32_t wrong = checkRows(ricmoo);
+
     if (nayuki.size != ricmoo->size) { wrong += (1 << 20); }
 
     int border = 4;
@@ -21,8 +57,1104 @@ static uint32_t check(const qrcodegen::QrCode &nayuki, QRCode *ricmoo) {
     return wrong;
 }
 
+// Runs the tasks in reverse order, so any dependency on evaluation order shows up
+static void reverseExecutor(void *context, void (*task)(void *arg, uint8_t index), void *arg, uint8_t count) {
+    (void)context;
+    while (count > 0) { task(arg, --count); }
+}
+
+// Checks that encoding with the given options produces exactly the same symbol
+static bool checkOptions(QRCode *expected, uint8_t version, uint8_t ecc, const char *data, const QRCodeOptions *options) {
+    QRCode qrcode;
+    uint8_t qrcodeBytes[qrcode_getBufferSize(version)];
+    qrcode_initBytesWithOptions(&qrcode, qrcodeBytes, version, ecc, (const uint8_t*)data, strlen(data), options);
+
+    if (qrcode.mask != expected->mask) { return false; }
+    return memcmp(qrcodeBytes, expected->modules, sizeof(qrcodeBytes)) == 0;
+}
+
+// Encodes every test case (and each again with an automatic version) as a single batch,
+// optionally across several threads, and checks each against Nayuki
+static void testBatch(const char **texts, int textCount, int threads, int *passed, int *total) {
+    std::vector<QRCodeBatchItem> items;
+    std::vector<uint8_t> buffers;
+
+    for (int version = 0; version <= 40; version++) {
+        if (LOCK_VERSION != 0 && version != 0 && LOCK_VERSION != version) { continue; }
+
+        for (int ecc = 0; ecc < 4; ecc++) {
+            for (int tc = 0; tc < textCount; tc++) {
+                QRCodeBatchItem item = { 0 };
+                item.data = (const uint8_t*)texts[tc];
+                item.length = strlen(texts[tc]);
+                item.version = version;
+                item.ecc = ecc;
+                items.push_back(item);
+            }
+        }
+    }
+
+    uint16_t bufferSize = qrcode_getBufferSize(LOCK_VERSION ? LOCK_VERSION: 40);
+    buffers.resize(items.size() * bufferSize);
+    for (size_t i = 0; i < items.size(); i++) { items[i].modules = &buffers[i * bufferSize]; }
+
+#if USE_PTHREADS
+    if (threads > 1) {
+        qrcode_initBatchThreaded(&items[0], items.size(), NULL, threads);
+    } else
+#else
+    (void)threads;
+#endif
+    qrcode_initBatch(&items[0], items.size(), NULL);
+
+    const qrcodegen::QrCode::Ecc *eccs[] = {
+        &qrcodegen::QrCode::Ecc::LOW, &qrcodegen::QrCode::Ecc::MEDIUM,
+        &qrcodegen::QrCode::Ecc::QUARTILE, &qrcodegen::QrCode::Ecc::HIGH
+    };
+
+    for (size_t i = 0; i < items.size(); i++) {
+        QRCodeBatchItem *item = &items[i];
+        const char *text = (const char*)item->data;
+
+        int minVersion = item->version ? item->version: 1;
+        int maxVersion = item->version ? item->version: 40;
+        if (LOCK_VERSION) { minVersion = maxVersion = LOCK_VERSION; }
+
+        std::vector<qrcodegen::QrSegment> segs(qrcodegen::QrSegment::makeSegments(text));
+        const qrcodegen::QrCode nayuki = qrcodegen::QrCode::encodeSegments(segs, *eccs[item->ecc], minVersion, maxVersion, -1, false);
+
+        if (item->result == 0 && check(nayuki, &item->qrcode) == 0) {
+            (*passed)++;
+        } else {
+            printf("Failed batch case: version=%d, ecc=%d, data=\"%s\"\n", item->version, item->ecc, text);
+        }
+        (*total)++;
+    }
+}
+
+// Encodes each text with an automatic version (with and without boosting the error
+// correction) and checks each against Nayuki, including which ones are too long
+static void testAutoVersion(const char **texts, int textCount, int *passed, int *total) {
+    const qrcodegen::QrCode::Ecc *eccs[] = {
+        &qrcodegen::QrCode::Ecc::LOW, &qrcodegen::QrCode::Ecc::MEDIUM,
+        &qrcodegen::QrCode::Ecc::QUARTILE, &qrcodegen::QrCode::Ecc::HIGH
+    };
+
+    int minVersion = LOCK_VERSION ? LOCK_VERSION: 1;
+    int maxVersion = LOCK_VERSION ? LOCK_VERSION: 40;
+
+    std::vector<uint8_t> buffer(qrcode_getBufferSize(maxVersion));
+
+    for (int tc = 0; tc < textCount; tc++) {
+        for (int ecc = 0; ecc < 4; ecc++) {
+            for (int boost = 0; boost < 2; boost++) {
+                const char *text = texts[tc];
+
+                QRCodeOptions options = { 0 };
+                options.boostEcc = boost;
+
+                QRCode qrcode;
+                int8_t result = qrcode_initBytesWithOptions(&qrcode, &buffer[0], 0, ecc, (const uint8_t*)text, strlen(text), &options);
+
+                bool ok;
+                try {
+                    std::vector<qrcodegen::QrSegment> segs(qrcodegen::QrSegment::makeSegments(text));
+                    const qrcodegen::QrCode nayuki = qrcodegen::QrCode::encodeSegments(segs, *eccs[ecc], minVersion, maxVersion, -1, boost);
+                    ok = (result == QRCODE_OK && check(nayuki, &qrcode) == 0);
+                    ok = ok && (qrcode.version == qrcode_getMinimumVersion(ecc, (const uint8_t*)text, strlen(text)));
+                } catch (const char *error) {
+                    ok = (result == QRCODE_ERROR_DATA_TOO_LONG && qrcode_getMinimumVersion(ecc, (const uint8_t*)text, strlen(text)) == 0);
+                }
+
+                if (ok) {
+                    (*passed)++;
+                } else {
+                    printf("Failed auto version case: ecc=%d, boost=%d, length=%d\n", ecc, boost, (int)strlen(text));
+                }
+                (*total)++;
+            }
+        }
+    }
+
+    // An explicit version which is too small, and invalid arguments
+    QRCode qrcode;
+    const char *text = texts[textCount - 1];
+    if (qrcode_initText(&qrcode, &buffer[0], minVersion, ECC_HIGH, text) == QRCODE_ERROR_DATA_TOO_LONG) { (*passed)++; }
+    if (qrcode_initText(&qrcode, &buffer[0], minVersion, 4, "HELLO") == QRCODE_ERROR_INVALID_ARGUMENT) { (*passed)++; }
+    if (qrcode_initText(&qrcode, &buffer[0], 41, ECC_LOW, "HELLO") == QRCODE_ERROR_INVALID_ARGUMENT) { (*passed)++; }
+    (*total) += 3;
+}
+
+// Whether the two bytes are a Shift JIS character in the ranges Kanji mode can encode
+static bool isKanjiPair(uint8_t first, uint8_t second) {
+    uint16_t value = (first << 8) | second;
+    if (second < 0x40 || second == 0x7F || second > 0xFC) { return false; }
+    return (value >= 0x8140 && value <= 0x9FFC) || (value >= 0xE040 && value <= 0xEBBF);
+}
+
+// Makes a Kanji mode segment of Shift JIS text (as in section 7.4.6 of ISO/IEC 18004)
+static qrcodegen::QrSegment makeKanji(const std::string &text) {
+    qrcodegen::BitBuffer bb;
+    for (size_t i = 0; i < text.size(); i += 2) {
+        int value = ((uint8_t)text[i] << 8) | (uint8_t)text[i + 1];
+        value -= (value <= 0x9FFC) ? 0x8140: 0xC140;
+        bb.appendBits((value >> 8) * 0xC0 + (value & 0xFF), 13);
+    }
+    return qrcodegen::QrSegment(qrcodegen::QrSegment::Mode::KANJI, text.size() / 2, bb.getBytes(), bb.getBitLength());
+}
+
+// As QrSegment::makeSegments, but with Kanji mode for Shift JIS text if kanji is set
+static std::vector<qrcodegen::QrSegment> makeSingleSegment(const std::string &text, bool kanji) {
+    bool allKanji = kanji && !text.empty() && (text.size() % 2) == 0;
+    for (size_t i = 0; allKanji && i < text.size(); i += 2) {
+        allKanji = isKanjiPair(text[i], text[i + 1]);
+    }
+
+    if (allKanji && !qrcodegen::QrSegment::isAlphanumeric(text.c_str())) {
+        return std::vector<qrcodegen::QrSegment>(1, makeKanji(text));
+    }
+    return qrcodegen::QrSegment::makeSegments(text.c_str());
+}
+
+// A port of Nayuki's QrSegmentAdvanced.makeSegmentsOptimally, with Shift JIS characters (if
+// kanji is set) in place of Unicode code points, falling back to a single segment unless
+// segmenting is strictly shorter
+static std::vector<qrcodegen::QrSegment> makeOptimalSegments(const std::string &text, int version, bool kanji) {
+    typedef qrcodegen::QrSegment QrSegment;
+    const QrSegment::Mode *modeTypes[] = { &QrSegment::Mode::BYTE, &QrSegment::Mode::ALPHANUMERIC, &QrSegment::Mode::NUMERIC, &QrSegment::Mode::KANJI };
+    int numModes = kanji ? 4: 3;
+
+    std::vector<QrSegment> single(makeSingleSegment(text, kanji));
+    if (text.empty()) { return single; }
+
+    // Split into characters of 1 or 2 bytes
+    std::vector<std::string> chars;
+    for (size_t i = 0; i < text.size(); ) {
+        size_t length = (kanji && i + 1 < text.size() && isKanjiPair(text[i], text[i + 1])) ? 2: 1;
+        chars.push_back(text.substr(i, length));
+        i += length;
+    }
+
+    int headCosts[4], prevCosts[4];
+    for (int i = 0; i < numModes; i++) {
+        headCosts[i] = (4 + modeTypes[i]->numCharCountBits(version)) * 6;
+        prevCosts[i] = headCosts[i];
+    }
+
+    std::vector<std::vector<int> > charModes(chars.size(), std::vector<int>(4, -1));
+    for (size_t i = 0; i < chars.size(); i++) {
+        char c = chars[i][0];
+        int curCosts[4];
+        curCosts[0] = prevCosts[0] + chars[i].size() * 48;
+        charModes[i][0] = 0;
+        if (chars[i].size() == 1 && strchr("0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ $%*+-./:", c) && c != 0) {
+            curCosts[1] = prevCosts[1] + 33;
+            charModes[i][1] = 1;
+        }
+        if (chars[i].size() == 1 && c >= '0' && c <= '9') {
+            curCosts[2] = prevCosts[2] + 20;
+            charModes[i][2] = 2;
+        }
+        if (chars[i].size() == 2) {
+            curCosts[3] = prevCosts[3] + 78;
+            charModes[i][3] = 3;
+        }
+
+        // Only the costs of the modes which can encode the character have been set so far
+        for (int j = 0; j < numModes; j++) {
+            for (int k = 0; k < numModes; k++) {
+                if (charModes[i][k] == -1) { continue; }
+                int newCost = (curCosts[k] + 5) / 6 * 6 + headCosts[j];
+                if (charModes[i][j] == -1 || newCost < curCosts[j]) {
+                    curCosts[j] = newCost;
+                    charModes[i][j] = k;
+                }
+            }
+        }
+
+        for (int j = 0; j < numModes; j++) { prevCosts[j] = curCosts[j]; }
+    }
+
+    int curMode = 0;
+    for (int i = 1; i < numModes; i++) {
+        if (prevCosts[i] < prevCosts[curMode]) { curMode = i; }
+    }
+
+    std::vector<int> modes(chars.size());
+    for (size_t i = chars.size(); i-- > 0; ) {
+        curMode = charModes[i][curMode];
+        modes[i] = curMode;
+    }
+
+    std::vector<QrSegment> segs;
+    for (size_t start = 0, end; start < chars.size(); start = end) {
+        std::string run;
+        for (end = start; end < chars.size() && modes[end] == modes[start]; end++) { run += chars[end]; }
+        if (modes[start] == 3) {
+            segs.push_back(makeKanji(run));
+        } else if (modes[start] == 2) {
+            segs.push_back(QrSegment::makeNumeric(run.c_str()));
+        } else if (modes[start] == 1) {
+            segs.push_back(QrSegment::makeAlphanumeric(run.c_str()));
+        } else {
+            segs.push_back(QrSegment::makeBytes(std::vector<uint8_t>(run.begin(), run.end())));
+        }
+    }
+
+    int segmentedBits = QrSegment::getTotalBits(segs, version);
+    int singleBits = QrSegment::getTotalBits(single, version);
+    if (segmentedBits != -1 && (singleBits == -1 || segmentedBits < singleBits)) { return segs; }
+    return single;
+}
+
+// Encodes each text with the given options (with an automatic version, and with the smallest
+// byte-mode version) and checks each against makeOptimalSegments or makeSingleSegment
+static void testSegments(const std::string *texts, int textCount, bool segmented, bool kanji, int *passed, int *total) {
+    const qrcodegen::QrCode::Ecc *eccs[] = {
+        &qrcodegen::QrCode::Ecc::LOW, &qrcodegen::QrCode::Ecc::MEDIUM,
+        &qrcodegen::QrCode::Ecc::QUARTILE, &qrcodegen::QrCode::Ecc::HIGH
+    };
+
+    int minVersion = LOCK_VERSION ? LOCK_VERSION: 1;
+    int maxVersion = LOCK_VERSION ? LOCK_VERSION: 40;
+
+    std::vector<uint8_t> buffer(qrcode_getBufferSize(maxVersion));
+
+    QRCodeOptions options = { 0 };
+    options.optimizeSegments = segmented;
+    options.kanji = kanji;
+    std::vector<uint8_t> workspace(qrcode_getWorkspaceSize(0, &options));
+
+    for (int tc = 0; tc < textCount; tc++) {
+        for (int ecc = 0; ecc < 4; ecc++) {
+            const std::string &text = texts[tc];
+            uint8_t singleVersion = qrcode_getMinimumVersion(ecc, (const uint8_t*)text.c_str(), text.size());
+
+            for (int explicitVersion = 0; explicitVersion < 2; explicitVersion++) {
+                if (explicitVersion && singleVersion == 0) { continue; }
+
+                // Explicit versions take their scratch buffers from a workspace
+                options.workspace = explicitVersion ? &workspace[0]: NULL;
+                options.workspaceSize = workspace.size();
+
+                QRCode qrcode;
+                int8_t result = qrcode_initBytesWithOptions(&qrcode, &buffer[0], explicitVersion ? singleVersion: 0, ecc, (const uint8_t*)text.c_str(), text.size(), &options);
+
+                // The first version the optimal segments fit in
+                bool ok = false;
+                int first = explicitVersion ? singleVersion: minVersion;
+                int last = explicitVersion ? singleVersion: maxVersion;
+                for (int version = first; version <= last && !ok; version++) {
+                    try {
+                        std::vector<qrcodegen::QrSegment> segs(segmented ? makeOptimalSegments(text, version, kanji): makeSingleSegment(text, kanji));
+                        const qrcodegen::QrCode nayuki = qrcodegen::QrCode::encodeSegments(segs, *eccs[ecc], version, version, -1, false);
+                        ok = (result == QRCODE_OK && check(nayuki, &qrcode) == 0);
+                        break;
+                    } catch (const char *error) { }
+                }
+                if (result == QRCODE_ERROR_DATA_TOO_LONG && singleVersion == 0 && !explicitVersion) {
+                    ok = true;
+                }
+
+                // Segmenting must never need a larger version
+                if (result == QRCODE_OK && singleVersion != 0 && qrcode.version > singleVersion) { ok = false; }
+
+                if (ok) {
+                    (*passed)++;
+                } else {
+                    printf("Failed segments case: segmented=%d, kanji=%d, ecc=%d, explicit=%d, length=%d\n", segmented, kanji, ecc, explicitVersion, (int)text.size());
+                }
+                (*total)++;
+            }
+        }
+    }
+
+    // A batch of the texts with automatic versions takes the character modes from the
+    // workspace too, and fails (as each single encode does) if it is not large enough for any;
+    // across threads, the workers find them again at the resolved versions
+    if (!segmented) { return; }
+    std::vector<QRCodeBatchItem> items(textCount);
+    std::vector<uint8_t> buffers(textCount * buffer.size());
+    options.workspace = &workspace[0];
+    for (int run = 0; run < (USE_PTHREADS ? 4: 2); run++) {
+        int small = run % 2;
+        memset(&items[0], 0, textCount * sizeof(QRCodeBatchItem));
+        for (int tc = 0; tc < textCount; tc++) {
+            items[tc].data = (const uint8_t*)texts[tc].c_str();
+            items[tc].length = texts[tc].size();
+            items[tc].modules = &buffers[tc * buffer.size()];
+        }
+        options.workspaceSize = workspace.size() - small;
+#if USE_PTHREADS
+        if (run >= 2) {
+            qrcode_initBatchThreaded(&items[0], textCount, &options, 3);
+        } else
+#endif
+        qrcode_initBatch(&items[0], textCount, &options);
+
+        bool ok = true;
+        for (int tc = 0; tc < textCount; tc++) {
+            QRCode qrcode;
+            int8_t result = qrcode_initBytesWithOptions(&qrcode, &buffer[0], 0, ECC_LOW, items[tc].data, items[tc].length, &options);
+            if (items[tc].result != result || (small && result != QRCODE_ERROR_INVALID_ARGUMENT)) { ok = false; }
+            if (result == QRCODE_OK && memcmp(items[tc].modules, &buffer[0], qrcode_getBufferSize(qrcode.version)) != 0) { ok = false; }
+        }
+
+        if (ok) {
+            (*passed)++;
+        } else {
+            printf("Failed segments batch: kanji=%d, small=%d, threaded=%d\n", kanji, small, run >= 2);
+        }
+        (*total)++;
+    }
+}
+
+// Encodes each text behind an ECI header (with an automatic version, then explicitly at that
+// version and the one below) and checks each against Nayuki with an ECI segment first
+static void testEci(const char **texts, int textCount, int *passed, int *total) {
+    const qrcodegen::QrCode::Ecc *eccs[] = {
+        &qrcodegen::QrCode::Ecc::LOW, &qrcodegen::QrCode::Ecc::MEDIUM,
+        &qrcodegen::QrCode::Ecc::QUARTILE, &qrcodegen::QrCode::Ecc::HIGH
+    };
+    const uint32_t ecis[] = { ECI_ISO_8859_1, ECI_UTF8, 200, 20000, 999999 };
+
+    int minVersion = LOCK_VERSION ? LOCK_VERSION: 1;
+    int maxVersion = LOCK_VERSION ? LOCK_VERSION: 40;
+
+    std::vector<uint8_t> buffer(qrcode_getBufferSize(maxVersion));
+
+    for (int tc = 0; tc < textCount; tc++) {
+        for (int e = 0; e < 5; e++) {
+            for (int ecc = 0; ecc < 4; ecc++) {
+                const char *text = texts[tc];
+
+                QRCodeOptions options = { 0 };
+                options.eci = ecis[e];
+
+                QRCode qrcode;
+                int8_t result = qrcode_initBytesWithOptions(&qrcode, &buffer[0], 0, ecc, (const uint8_t*)text, strlen(text), &options);
+
+                bool ok;
+                try {
+                    std::vector<qrcodegen::QrSegment> segs(1, qrcodegen::QrSegment::makeEci(ecis[e]));
+                    std::vector<qrcodegen::QrSegment> dataSegs(qrcodegen::QrSegment::makeSegments(text));
+                    for (size_t i = 0; i < dataSegs.size(); i++) { segs.push_back(dataSegs[i]); }
+                    const qrcodegen::QrCode nayuki = qrcodegen::QrCode::encodeSegments(segs, *eccs[ecc], minVersion, maxVersion, -1, false);
+                    ok = (result == QRCODE_OK && check(nayuki, &qrcode) == 0);
+
+                    // The header counts against the capacity of an explicit version too
+                    int8_t explicitResult = qrcode_initBytesWithOptions(&qrcode, &buffer[0], nayuki.version, ecc, (const uint8_t*)text, strlen(text), &options);
+                    ok = ok && (explicitResult == QRCODE_OK && check(nayuki, &qrcode) == 0);
+                    if (nayuki.version > minVersion) {
+                        explicitResult = qrcode_initBytesWithOptions(&qrcode, &buffer[0], nayuki.version - 1, ecc, (const uint8_t*)text, strlen(text), &options);
+                        ok = ok && (explicitResult == QRCODE_ERROR_DATA_TOO_LONG);
+                    }
+                } catch (const char *error) {
+                    ok = (result == QRCODE_ERROR_DATA_TOO_LONG);
+                }
+
+                if (ok) {
+                    (*passed)++;
+                } else {
+                    printf("Failed ECI case: eci=%u, ecc=%d, length=%d\n", ecis[e], ecc, (int)strlen(text));
+                }
+                (*total)++;
+            }
+        }
+    }
+
+    // Assignment numbers need at most 6 digits
+    QRCode qrcode;
+    QRCodeOptions options = { 0 };
+    options.eci = 1000000;
+    if (qrcode_initBytesWithOptions(&qrcode, &buffer[0], 0, ECC_LOW, (const uint8_t*)"HELLO", 5, &options) == QRCODE_ERROR_INVALID_ARGUMENT) { (*passed)++; }
+    (*total)++;
+}
+
+// Places each byte value among digits (or alphanumerics) at positions in and after the
+// vectorized blocks, and checks the mode chosen for the whole text
+static void testModes(int *passed, int *total) {
+    const char *alphanumerics = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ $%*+-./:";
+    std::vector<uint8_t> buffer(qrcode_getBufferSize(LOCK_VERSION ? LOCK_VERSION: 40));
+
+    int failed = 0;
+    for (int value = 0; value < 256; value++) {
+        bool isDigit = (value >= '0' && value <= '9');
+        bool isAlphanumeric = (value != 0 && strchr(alphanumerics, value) != NULL);
+
+        for (int base = 0; base < 2; base++) {
+            uint8_t expected = isDigit ? (base ? MODE_ALPHANUMERIC: MODE_NUMERIC): (isAlphanumeric ? MODE_ALPHANUMERIC: MODE_BYTE);
+
+            const int positions[] = { 0, 7, 15, 16, 31, 32, 36 };
+            for (int p = 0; p < 7; p++) {
+                uint8_t text[37];
+                for (int i = 0; i < 37; i++) { text[i] = (base && i % 3 == 0) ? 'Z': '0' + i % 10; }
+                text[positions[p]] = value;
+
+                QRCode qrcode;
+                if (qrcode_initBytes(&qrcode, &buffer[0], LOCK_VERSION, ECC_LOW, text, sizeof(text)) != QRCODE_OK || qrcode.mode != expected) {
+                    printf("Failed mode case: value=%d, base=%d, position=%d\n", value, base, positions[p]);
+                    failed++;
+                }
+            }
+        }
+    }
+
+    if (failed == 0) { (*passed)++; }
+    (*total)++;
+}
+
+// Splits each text into a Structured Append sequence (serially and through an executor) and
+// checks each symbol against Nayuki with the same header, and that the parts add up
+static void testStructuredAppend(const std::string *texts, int textCount, int *passed, int *total) {
+    const qrcodegen::QrCode::Ecc *eccs[] = {
+        &qrcodegen::QrCode::Ecc::LOW, &qrcodegen::QrCode::Ecc::MEDIUM,
+        &qrcodegen::QrCode::Ecc::QUARTILE, &qrcodegen::QrCode::Ecc::HIGH
+    };
+    const uint8_t maxVersions[] = { 0, 25 };
+
+    for (int tc = 0; tc < textCount; tc++) {
+        for (int ecc = 0; ecc < 4; ecc += 3) {
+            for (int mv = 0; mv < 2; mv++) {
+                for (int concurrent = 0; concurrent < 2; concurrent++) {
+                    const std::string &text = texts[tc];
+
+                    QRCodeOptions options = { 0 };
+                    if (concurrent) { options.executor = reverseExecutor; }
+
+                    QRCodeBatchItem items[16];
+                    memset(items, 0, sizeof(items));
+                    uint8_t count = qrcode_planStructuredAppend(items, 16, maxVersions[mv], ecc, (const uint8_t*)text.data(), text.size(), &options);
+
+                    std::vector<std::vector<uint8_t> > buffers(count);
+                    std::string joined;
+                    uint8_t parity = 0;
+                    bool ok = (count > 0);
+                    for (int i = 0; i < count; i++) {
+                        buffers[i].resize(qrcode_getBufferSize(items[i].version));
+                        items[i].modules = &buffers[i][0];
+                        joined.append((const char*)items[i].data, items[i].length);
+                        if (maxVersions[mv] && items[i].version > maxVersions[mv]) { ok = false; }
+                    }
+                    for (size_t i = 0; i < text.size(); i++) { parity ^= (uint8_t)text[i]; }
+                    ok = ok && (joined == text) && (qrcode_initStructuredAppend(items, count, &options) == count);
+
+                    for (int i = 0; i < count && ok; i++) {
+                        qrcodegen::BitBuffer bb;
+                        bb.appendBits(i, 4);
+                        bb.appendBits(count - 1, 4);
+                        bb.appendBits(parity, 8);
+                        std::vector<qrcodegen::QrSegment> segs(1, qrcodegen::QrSegment(qrcodegen::QrSegment::Mode::STRUCTURED_APPEND, 0, bb.getBytes(), bb.getBitLength()));
+
+                        std::string part((const char*)items[i].data, items[i].length);
+                        std::vector<qrcodegen::QrSegment> dataSegs(qrcodegen::QrSegment::makeSegments(part.c_str()));
+                        for (size_t j = 0; j < dataSegs.size(); j++) { segs.push_back(dataSegs[j]); }
+
+                        const qrcodegen::QrCode nayuki = qrcodegen::QrCode::encodeSegments(segs, *eccs[ecc], items[i].version, items[i].version, -1, false);
+                        ok = (items[i].result == QRCODE_OK && check(nayuki, &items[i].qrcode) == 0);
+                    }
+
+                    if (ok) {
+                        (*passed)++;
+                    } else {
+                        printf("Failed structured append case: ecc=%d, maxVersion=%d, concurrent=%d, length=%d\n", ecc, maxVersions[mv], concurrent, (int)text.size());
+                    }
+                    (*total)++;
+                }
+            }
+        }
+    }
+
+    // Planning while segmenting takes the character modes from the workspace, if it is large
+    // enough for the largest version
+    QRCodeOptions options = { 0 };
+    options.optimizeSegments = true;
+    QRCodeBatchItem planned[16], items[16];
+    uint8_t plannedCount = qrcode_planStructuredAppend(planned, 16, 25, ECC_LOW, (const uint8_t*)texts[1].data(), texts[1].size(), &options);
+    std::vector<uint8_t> workspace(qrcode_getWorkspaceSize(25, &options));
+    options.workspace = &workspace[0];
+    options.workspaceSize = workspace.size();
+    bool ok = (plannedCount > 0 && qrcode_planStructuredAppend(items, 16, 25, ECC_LOW, (const uint8_t*)texts[1].data(), texts[1].size(), &options) == plannedCount);
+    for (int i = 0; i < plannedCount && ok; i++) {
+        ok = (items[i].version == planned[i].version && items[i].length == planned[i].length);
+    }
+    options.workspaceSize--;
+    if (ok && qrcode_planStructuredAppend(items, 16, 25, ECC_LOW, (const uint8_t*)texts[1].data(), texts[1].size(), &options) == 0) { (*passed)++; }
+    (*total)++;
+
+    // Shift JIS text split into parts of an odd number of bytes is cut between its double-byte
+    // characters, so every part is still all Kanji
+    std::string kanjiText;
+    for (int i = 0; i < 101; i++) { kanjiText += "\x93\x5F"; }
+    QRCodeOptions kanjiOptions = { 0 };
+    kanjiOptions.kanji = true;
+    uint8_t kanjiCount = qrcode_planStructuredAppend(items, 16, 3, ECC_LOW, (const uint8_t*)kanjiText.data(), kanjiText.size(), &kanjiOptions);
+    std::vector<std::vector<uint8_t> > kanjiBuffers(kanjiCount);
+    ok = (kanjiCount > 1);
+    for (int i = 0; i < kanjiCount; i++) {
+        kanjiBuffers[i].resize(qrcode_getBufferSize(items[i].version));
+        items[i].modules = &kanjiBuffers[i][0];
+    }
+    ok = ok && (qrcode_initStructuredAppend(items, kanjiCount, &kanjiOptions) == kanjiCount);
+    for (int i = 0; i < kanjiCount && ok; i++) {
+        qrcodegen::BitBuffer bb;
+        bb.appendBits(i, 4);
+        bb.appendBits(kanjiCount - 1, 4);
+        bb.appendBits(0x93 ^ 0x5F, 8);
+        std::vector<qrcodegen::QrSegment> segs(1, qrcodegen::QrSegment(qrcodegen::QrSegment::Mode::STRUCTURED_APPEND, 0, bb.getBytes(), bb.getBitLength()));
+
+        std::string part((const char*)items[i].data, items[i].length);
+        std::vector<qrcodegen::QrSegment> dataSegs(makeSingleSegment(part, true));
+        for (size_t j = 0; j < dataSegs.size(); j++) { segs.push_back(dataSegs[j]); }
+
+        const qrcodegen::QrCode nayuki = qrcodegen::QrCode::encodeSegments(segs, qrcodegen::QrCode::Ecc::LOW, items[i].version, items[i].version, -1, false);
+        ok = (items[i].result == QRCODE_OK && items[i].qrcode.mode == MODE_KANJI && check(nayuki, &items[i].qrcode) == 0);
+    }
+    if (ok) {
+        (*passed)++;
+    } else {
+        printf("Failed structured append Kanji case: count=%d\n", kanjiCount);
+    }
+    (*total)++;
+
+    // More than 16 symbols' worth
+    std::string tooLong(LOCK_VERSION ? 2000: 60000, 'q');
+    if (qrcode_planStructuredAppend(items, 16, 0, ECC_LOW, (const uint8_t*)tooLong.data(), tooLong.size(), NULL) == 0) { (*passed)++; }
+    (*total)++;
+}
+
+// Feeds each text in several numbers of (evenly sized) pieces, which split digit groups and
+// double-byte characters, and checks the result is exactly the symbol encoded from the whole
+// text, including which ones are too long
+static void testStream(const std::string *texts, int textCount, const QRCodeOptions *options, int *passed, int *total) {
+    int maxVersion = LOCK_VERSION ? LOCK_VERSION: 40;
+    std::vector<uint8_t> expectedBytes(qrcode_getBufferSize(maxVersion)), streamBytes(qrcode_getBufferSize(maxVersion));
+    const int pieceCounts[] = { 1, 2, 3, STREAM_MAX_PIECES };
+
+    for (int tc = 0; tc < textCount; tc++) {
+        for (int explicitVersion = 0; explicitVersion < 2; explicitVersion++) {
+            for (int pc = 0; pc < 4; pc++) {
+                const std::string &text = texts[tc];
+
+                QRCode expected;
+                int8_t expectedResult = qrcode_initBytesWithOptions(&expected, &expectedBytes[0], 0, ECC_MEDIUM, (const uint8_t*)text.data(), text.size(), options);
+                uint8_t version = (explicitVersion && expectedResult == QRCODE_OK) ? expected.version: 0;
+                if (version == 0 && explicitVersion) { continue; }
+
+                QRCode qrcode;
+                QRCodeStream stream;
+                int8_t result = qrcode_beginStream(&stream, &qrcode, &streamBytes[0], version, ECC_MEDIUM, options);
+                for (int i = 0; i < pieceCounts[pc]; i++) {
+                    size_t start = text.size() * i / pieceCounts[pc], end = text.size() * (i + 1) / pieceCounts[pc];
+                    if (result == QRCODE_OK) { result = qrcode_feedStream(&stream, (const uint8_t*)&text[start], end - start); }
+                }
+                if (result == QRCODE_OK) { result = qrcode_finishStream(&stream); }
+
+                bool ok;
+                if (expectedResult == QRCODE_OK) {
+                    ok = (result == QRCODE_OK && qrcode.version == expected.version && qrcode.ecc == expected.ecc && qrcode.mask == expected.mask);
+                    ok = ok && memcmp(&streamBytes[0], &expectedBytes[0], qrcode_getBufferSize(expected.version)) == 0;
+                } else {
+                    ok = (result == expectedResult && qrcode_finishStream(&stream) == result);
+                }
+
+                if (ok) {
+                    (*passed)++;
+                } else {
+                    printf("Failed stream case: explicit=%d, pieces=%d, length=%d\n", explicitVersion, pieceCounts[pc], (int)text.size());
+                }
+                (*total)++;
+            }
+        }
+    }
+
+    // Numeric data longer than the modules buffer (up to the most digits the version holds
+    // with an ECI header), split unevenly, both streamed and as parts
+    const int lengths[] = { LOCK_VERSION ? 120: 500, LOCK_VERSION ? 123: 7085 };
+    for (int i = 0; i < 2; i++) {
+        uint8_t version = LOCK_VERSION ? LOCK_VERSION: (i ? 40: 10);
+        std::string digits;
+        for (int j = 0; j < lengths[i]; j++) { digits += (char)('0' + j * 7 % 10); }
+
+        QRCode expected, qrcode;
+        int8_t expectedResult = qrcode_initBytesWithOptions(&expected, &expectedBytes[0], version, ECC_LOW, (const uint8_t*)digits.data(), digits.size(), options);
+
+        const uint8_t *parts[3] = { (const uint8_t*)digits.data(), (const uint8_t*)&digits[1], (const uint8_t*)&digits[101] };
+        const uint16_t partLengths[3] = { 1, 100, (uint16_t)(digits.size() - 101) };
+        bool ok = (expectedResult == QRCODE_OK && digits.size() > qrcode_getBufferSize(version));
+        for (int streamed = 0; streamed < 2 && ok; streamed++) {
+            memset(&streamBytes[0], 0, streamBytes.size());
+            if (streamed) {
+                QRCodeStream stream;
+                qrcode_beginStream(&stream, &qrcode, &streamBytes[0], version, ECC_LOW, options);
+                for (int j = 0; j < 3; j++) { qrcode_feedStream(&stream, parts[j], partLengths[j]); }
+                ok = (qrcode_finishStream(&stream) == QRCODE_OK);
+            } else {
+                ok = (qrcode_initPartsWithOptions(&qrcode, &streamBytes[0], version, ECC_LOW, parts, partLengths, 3, options) == QRCODE_OK);
+            }
+            ok = ok && (qrcode.version == expected.version && qrcode.mask == expected.mask);
+            ok = ok && memcmp(&streamBytes[0], &expectedBytes[0], qrcode_getBufferSize(version)) == 0;
+        }
+
+        if (ok) {
+            (*passed)++;
+        } else {
+            printf("Failed stream numeric case: length=%d\n", lengths[i]);
+        }
+        (*total)++;
+    }
+
+    // More pieces than the stream holds (empty ones are not counted), which sticks until the end
+    QRCode qrcode;
+    QRCodeStream stream;
+    bool ok = (qrcode_beginStream(&stream, &qrcode, &streamBytes[0], 0, ECC_LOW, options) == QRCODE_OK);
+    ok = ok && (qrcode_feedStream(&stream, (const uint8_t*)"", 0) == QRCODE_OK);
+    for (int i = 0; i < STREAM_MAX_PIECES; i++) {
+        ok = ok && (qrcode_feedStream(&stream, (const uint8_t*)"7", 1) == QRCODE_OK);
+    }
+    ok = ok && (qrcode_feedStream(&stream, (const uint8_t*)"7", 1) == QRCODE_ERROR_INVALID_ARGUMENT);
+    ok = ok && (qrcode_finishStream(&stream) == QRCODE_ERROR_INVALID_ARGUMENT);
+    if (ok) { (*passed)++; }
+    (*total)++;
+}
+
+// Collects the output of the image writers, failing once limit pieces have been written
+struct ImageOutput {
+    std::string data;
+    int pieces;
+    int limit;
+};
+
+static bool writeImage(void *context, const uint8_t *data, uint32_t length) {
+    ImageOutput *output = (ImageOutput*)context;
+    if (output->pieces++ == output->limit) { return false; }
+    output->data.append((const char*)data, length);
+    return true;
+}
+
+static uint32_t readLittleEndian(const std::string &data, size_t offset, int length) {
+    uint32_t value = 0;
+    for (int i = length - 1; i >= 0; i--) { value = (value << 8) | (uint8_t)data[offset + i]; }
+    return value;
+}
+
+static uint32_t readBigEndian(const std::string &data, size_t offset) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) { value = (value << 8) | (uint8_t)data[offset + i]; }
+    return value;
+}
+
+static uint32_t crc32(const std::string &data, size_t offset, size_t length) {
+    uint32_t crc = 0xffffffff;
+    for (size_t i = offset; i < offset + length; i++) {
+        crc ^= (uint8_t)data[i];
+        for (int k = 0; k < 8; k++) { crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320: 0); }
+    }
+    return crc ^ 0xffffffff;
+}
+
+// Decompresses a zlib stream of fixed Huffman blocks (all qrcode_writePng produces),
+// returning false if it is malformed or its checksum is wrong
+static bool inflateFixed(const std::string &input, std::string *output) {
+    static const int lengthBases[] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+    static const int lengthExtra[] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+
+    size_t bit = 16;
+    auto readBits = [&](int count) {
+        uint32_t value = 0;
+        for (int i = 0; i < count; i++, bit++) {
+            if (bit / 8 >= input.size()) { throw 0; }
+            value |= (((uint8_t)input[bit / 8] >> (bit % 8)) & 1) << i;
+        }
+        return value;
+    };
+    auto readCode = [&](int count) {
+        uint32_t value = 0;
+        for (int i = 0; i < count; i++) { value = (value << 1) | readBits(1); }
+        return value;
+    };
+
+    try {
+        if (input.size() < 6 || (((uint8_t)input[0] << 8) | (uint8_t)input[1]) % 31 != 0) { return false; }
+        bool final = false;
+        while (!final) {
+            final = readBits(1);
+            if (readBits(2) != 1) { return false; }
+            while (true) {
+                // 7 bit codes are 256 to 279, 8 bit codes 0 to 143 and 280 to 287, and 9 bit codes 144 to 255
+                uint32_t code = readCode(7), symbol;
+                if (code < 24) {
+                    symbol = 256 + code;
+                } else {
+                    code = (code << 1) | readBits(1);
+                    if (code < 0xC0) {
+                        symbol = code - 0x30;
+                    } else if (code < 0xC8) {
+                        symbol = 280 + code - 0xC0;
+                    } else {
+                        symbol = 144 + ((code << 1) | readBits(1)) - 0x190;
+                    }
+                }
+
+                if (symbol < 256) {
+                    *output += (char)symbol;
+                    continue;
+                } else if (symbol == 256) {
+                    break;
+                } else if (symbol > 285) {
+                    return false;
+                }
+
+                int length = lengthBases[symbol - 257] + readBits(lengthExtra[symbol - 257]);
+                uint32_t distanceCode = readCode(5);
+                if (distanceCode > 29) { return false; }
+                int extra = distanceCode < 4 ? 0: distanceCode / 2 - 1;
+                size_t distance = (distanceCode < 4 ? distanceCode + 1: ((2 + (distanceCode & 1)) << extra) + 1) + readBits(extra);
+                if (distance > output->size()) { return false; }
+                for (int i = 0; i < length; i++) { *output += (*output)[output->size() - distance]; }
+            }
+        }
+    } catch (int) {
+        return false;
+    }
+
+    uint32_t a = 1, b = 0;
+    for (size_t i = 0; i < output->size(); i++) {
+        a = (a + (uint8_t)(*output)[i]) % 65521;
+        b = (b + a) % 65521;
+    }
+    size_t end = (bit + 7) / 8;
+    return end + 4 == input.size() && readBigEndian(input, end) == ((b << 16) | a);
+}
+
+// Checks the raster lines, and the PBM, BMP and PNG images, of the symbol at several scales
+// against qrcode_getModule
+static void testImages(QRCode *qrcode, int *passed, int *total) {
+    const int scales[] = { 1, 3, 8, 9 };
+    const int borders[] = { 0, 4 };
+
+    for (int sc = 0; sc < 4; sc++) {
+        for (int bc = 0; bc < 2; bc++) {
+            int scale = scales[sc], border = borders[bc];
+            int width = (qrcode->size + 2 * border) * scale;
+            bool ok = true;
+
+            // The pixel at (x, y) of the image, including the quiet zone
+            #define PIXEL(x, y)   qrcode_getModule(qrcode, (x) / scale - border, (y) / scale - border)
+
+            std::vector<uint8_t> line(qrcode_getRasterLineSize(qrcode, scale, border) + 1, 0xAA);
+            ok = ok && (line.size() - 1 == (size_t)(width + 7) / 8);
+            for (int y = -border; y < qrcode->size + border; y++) {
+                qrcode_getRasterLine(qrcode, y, scale, border, &line[0]);
+                for (int x = 0; x < (int)(line.size() - 1) * 8; x++) {
+                    bool expected = x < width && PIXEL(x, (y + border) * scale);
+                    if (!!(line[x >> 3] & (0x80 >> (x & 7))) != expected) { ok = false; }
+                }
+                if (line.back() != 0xAA) { ok = false; }
+            }
+
+            ImageOutput pbm = { "", 0, -1 };
+            ok = ok && qrcode_writePbm(qrcode, scale, border, writeImage, &pbm) == QRCODE_OK;
+            std::string header = "P4\n" + std::to_string(width) + " " + std::to_string(width) + "\n";
+            int stride = (width + 7) / 8;
+            ok = ok && pbm.data.size() == header.size() + stride * width && pbm.data.compare(0, header.size(), header) == 0;
+            for (int y = 0; ok && y < width; y++) {
+                for (int x = 0; x < width; x++) {
+                    bool bit = !!(pbm.data[header.size() + y * stride + (x >> 3)] & (0x80 >> (x & 7)));
+                    if (bit != PIXEL(x, y)) { ok = false; }
+                }
+            }
+
+            ImageOutput bmp = { "", 0, -1 };
+            ok = ok && qrcode_writeBmp(qrcode, scale, border, writeImage, &bmp) == QRCODE_OK;
+            stride = (width + 31) / 32 * 4;
+            ok = ok && bmp.data.size() == 62 + (size_t)stride * width && bmp.data.compare(0, 2, "BM") == 0;
+            ok = ok && readLittleEndian(bmp.data, 2, 4) == bmp.data.size() && readLittleEndian(bmp.data, 10, 4) == 62;
+            ok = ok && readLittleEndian(bmp.data, 18, 4) == (uint32_t)width && readLittleEndian(bmp.data, 22, 4) == (uint32_t)width;
+            ok = ok && readLittleEndian(bmp.data, 28, 2) == 1 && readLittleEndian(bmp.data, 54, 4) == 0xFFFFFF && readLittleEndian(bmp.data, 58, 4) == 0;
+            for (int y = 0; ok && y < width; y++) {
+                for (int x = 0; x < stride * 8; x++) {
+                    bool bit = !!(bmp.data[62 + (width - 1 - y) * stride + (x >> 3)] & (0x80 >> (x & 7)));
+                    if (bit != (x < width && PIXEL(x, y))) { ok = false; }
+                }
+            }
+
+            // The chunks (each with a valid CRC) of the PNG, holding 1-bit grayscale scanlines with
+            // no filtering, in which 0 is black
+            ImageOutput png = { "", 0, -1 };
+            ok = ok && qrcode_writePng(qrcode, scale, border, writeImage, &png) == QRCODE_OK;
+            ok = ok && png.data.compare(0, 8, "\x89PNG\r\n\x1a\n") == 0;
+            std::string chunkTypes, compressed, pixels;
+            for (size_t offset = 8; ok && offset < png.data.size(); ) {
+                uint32_t length = readBigEndian(png.data, offset);
+                ok = offset + 12 + length <= png.data.size() && crc32(png.data, offset + 4, 4 + length) == readBigEndian(png.data, offset + 8 + length);
+                std::string type = png.data.substr(offset + 4, 4);
+                if (ok && type == "IHDR") {
+                    ok = length == 13 && readBigEndian(png.data, offset + 8) == (uint32_t)width && readBigEndian(png.data, offset + 12) == (uint32_t)width;
+                    ok = ok && png.data.compare(offset + 16, 5, std::string("\x01\x00\x00\x00\x00", 5)) == 0;
+                } else if (type == "IDAT") {
+                    compressed += png.data.substr(offset + 8, length);
+                }
+                if (chunkTypes.empty() || type != chunkTypes.substr(chunkTypes.size() - 4)) { chunkTypes += type; }
+                offset += 12 + length;
+            }
+            ok = ok && chunkTypes == "IHDRIDATIEND" && inflateFixed(compressed, &pixels);
+            stride = (width + 7) / 8;
+            ok = ok && pixels.size() == (size_t)(stride + 1) * width;
+            for (int y = 0; ok && y < width; y++) {
+                if (pixels[y * (stride + 1)] != 0) { ok = false; }
+                for (int x = 0; x < width; x++) {
+                    bool bit = !!(pixels[y * (stride + 1) + 1 + (x >> 3)] & (0x80 >> (x & 7)));
+                    if (bit == PIXEL(x, y)) { ok = false; }
+                }
+            }
+
+            #undef PIXEL
+
+            if (ok) {
+                (*passed)++;
+            } else {
+                printf("Failed image case: version=%d, scale=%d, border=%d\n", qrcode->version, scale, border);
+            }
+            (*total)++;
+        }
+    }
+
+    // A writer failing on the header or partway through, and a scale of 0
+    ImageOutput failing = { "", 0, 0 };
+    bool ok = qrcode_writePbm(qrcode, 2, 4, writeImage, &failing) == QRCODE_ERROR_WRITE_FAILED;
+    failing.pieces = 0;
+    failing.limit = 5;
+    ok = ok && qrcode_writeBmp(qrcode, 2, 4, writeImage, &failing) == QRCODE_ERROR_WRITE_FAILED && failing.pieces == 6;
+    failing.pieces = 0;
+    failing.limit = 3;
+    ok = ok && qrcode_writePng(qrcode, 2, 4, writeImage, &failing) == QRCODE_ERROR_WRITE_FAILED && failing.pieces == 4;
+    ok = ok && qrcode_writeBmp(qrcode, 0, 4, writeImage, &failing) == QRCODE_ERROR_INVALID_ARGUMENT;
+    ok = ok && qrcode_writePng(qrcode, 0, 4, writeImage, &failing) == QRCODE_ERROR_INVALID_ARGUMENT;
+    if (ok) { (*passed)++; }
+    (*total)++;
+}
+
+// Checks the SVG and PDF content of the symbol by drawing each rectangle into a grid of
+// the modules (with the quiet zone), which must then match qrcode_getModule
+static void testVectors(QRCode *qrcode, int *passed, int *total) {
+    for (int border = 0; border <= 4; border += 4) {
+        int width = qrcode->size + 2 * border;
+
+        for (int format = 0; format < 2; format++) {
+            uint32_t (*get)(QRCode*, uint8_t, char*, uint32_t) = format ? qrcode_getPdfContent: qrcode_getSvg;
+            int8_t (*write)(QRCode*, uint8_t, QRCodeWriter, void*) = format ? qrcode_writePdfContent: qrcode_writeSvg;
+
+            // The size up front, the text in a buffer of exactly that size, through a writer,
+            // and truncated to a small buffer
+            uint32_t length = get(qrcode, border, NULL, 0);
+            std::vector<char> text(length + 1, 'X');
+            bool ok = get(qrcode, border, &text[0], text.size()) == length && strlen(&text[0]) == length;
+            ImageOutput output = { "", 0, -1 };
+            ok = ok && write(qrcode, border, writeImage, &output) == QRCODE_OK && output.data == &text[0];
+            char small[11];
+            ok = ok && get(qrcode, border, small, sizeof(small)) == length && strlen(small) == 10 && strncmp(small, &text[0], 10) == 0;
+            ImageOutput failing = { "", 0, 0 };
+            ok = ok && write(qrcode, border, writeImage, &failing) == QRCODE_ERROR_WRITE_FAILED && failing.pieces == 1;
+
+            std::vector<bool> grid(width * width);
+            int x, y, w, w2, n, rectangles = 0;
+            if (format == 0) {
+                std::string header = "<svg xmlns=\"http://www.w3.org/2000/svg\" version=\"1.1\" viewBox=\"0 0 " + std::to_string(width) + " " + std::to_string(width) + "\"";
+                std::string path(&text[0]);
+                size_t start = path.find(" d=\"") + 4;
+                ok = ok && path.compare(0, header.size(), header) == 0 && path.substr(path.size() - 7) == "</svg>\n";
+                for (const char *d = &path[start]; ok && *d != '"'; d += n, rectangles++) {
+                    ok = sscanf(d, "M%d %dh%dv1h-%d%n", &x, &y, &w, &w2, &n) == 4 && w == w2;
+                    for (int i = 0; ok && i < w; i++) { grid[y * width + x + i] = true; }
+                }
+            } else {
+                ok = ok && strncmp(&text[0], "0 g\n", 4) == 0 && strcmp(&text[length - 2], "f\n") == 0;
+                for (const char *d = &text[4]; ok && *d != 'f'; d += n, rectangles++) {
+                    ok = sscanf(d, "%d %d %d 1 re\n%n", &x, &y, &w, &n) == 3;
+                    for (int i = 0; ok && i < w; i++) { grid[(width - 1 - y) * width + x + i] = true; }
+                }
+            }
+
+            int dark = 0;
+            for (y = 0; ok && y < width; y++) {
+                for (x = 0; x < width; x++) {
+                    if (grid[y * width + x] != qrcode_getModule(qrcode, x - border, y - border)) { ok = false; }
+                    dark += grid[y * width + x];
+                }
+            }
+            ok = ok && rectangles < dark;
+
+            if (ok) {
+                (*passed)++;
+            } else {
+                printf("Failed vector case: version=%d, border=%d, format=%d\n", qrcode->version, border, format);
+            }
+            (*total)++;
+        }
+    }
+}
+
+// Checks the text drawings of the symbol by reading each character back as the pair of
+// modules above each other, which must match qrcode_getModule
+static void testText(QRCode *qrcode, int *passed, int *total) {
+    const char *glyphs[2][4] = {
+        { " ", "\xe2\x96\x84", "\xe2\x96\x80", "\xe2\x96\x88" },
+        { " ", ",", "\"", "#" }
+    };
+
+    for (int style = 0; style < 4; style++) {
+        for (int border = 0; border <= 3; border += 3) {
+            int width = qrcode->size + 2 * border, lines = (width + 1) / 2;
+            bool ascii = (style & TEXT_ASCII), inverted = (style & TEXT_INVERTED);
+
+            std::vector<char> buffer(qrcode_getTextLineSize(qrcode, border), 'X');
+            std::string text;
+            bool ok = true;
+            for (int line = 0; line < lines; line++) {
+                uint16_t length = qrcode_getTextLine(qrcode, line, border, style, &buffer[0]);
+                ok = ok && length + 1u <= buffer.size() && strlen(&buffer[0]) == length && buffer[length - 1] == '\n';
+                text += &buffer[0];
+
+                const char *character = &buffer[0];
+                for (int x = 0; ok && x < width; x++) {
+                    bool top = qrcode_getModule(qrcode, x - border, 2 * line - border) != inverted;
+                    // The half row past an odd number of rows is light, like the quiet zone
+                    bool bottom = ((2 * line + 1 < width) && qrcode_getModule(qrcode, x - border, 2 * line + 1 - border)) != inverted;
+                    const char *glyph = glyphs[ascii][(top ? 2: 0) | (bottom ? 1: 0)];
+                    ok = strncmp(character, glyph, strlen(glyph)) == 0;
+                    character += strlen(glyph);
+                }
+                ok = ok && strcmp(character, "\n") == 0;
+            }
+
+            ImageOutput output = { "", 0, -1 };
+            ok = ok && qrcode_writeText(qrcode, border, style, writeImage, &output) == QRCODE_OK && output.data == text;
+            ImageOutput failing = { "", 0, 1 };
+            ok = ok && qrcode_writeText(qrcode, border, style, writeImage, &failing) == QRCODE_ERROR_WRITE_FAILED && failing.pieces == 2;
+
+            if (ok) {
+                (*passed)++;
+            } else {
+                printf("Failed text case: version=%d, border=%d, style=%d\n", qrcode->version, border, style);
+            }
+            (*total)++;
+        }
+    }
+}
+
+// Nayuki's penalty score (QrCode::getPenaltyScore) of the modules, read with qrcode_getModule
+static uint32_t referencePenalty(QRCode *qrcode) {
+    int size = qrcode->size;
+    uint32_t result = 0;
+
+    for (int i = 0; i < size; i++) {
+        for (int vertical = 0; vertical < 2; vertical++) {
+            bool color = vertical ? qrcode_getModule(qrcode, i, 0): qrcode_getModule(qrcode, 0, i);
+            for (int j = 1, run = 1; j < size; j++) {
+                bool module = vertical ? qrcode_getModule(qrcode, i, j): qrcode_getModule(qrcode, j, i);
+                if (module != color) {
+                    color = module;
+                    run = 1;
+                } else if (++run == 5) {
+                    result += 3;
+                } else if (run > 5) {
+                    result++;
+                }
+            }
+        }
+    }
+
+    for (int y = 0; y < size - 1; y++) {
+        for (int x = 0; x < size - 1; x++) {
+            bool color = qrcode_getModule(qrcode, x, y);
+            if (color == qrcode_getModule(qrcode, x + 1, y) && color == qrcode_getModule(qrcode, x, y + 1) && color == qrcode_getModule(qrcode, x + 1, y + 1)) {
+                result += 3;
+            }
+        }
+    }
+
+    for (int i = 0; i < size; i++) {
+        for (int vertical = 0; vertical < 2; vertical++) {
+            for (int j = 0, bits = 0; j < size; j++) {
+                bits = ((bits << 1) & 0x7FF) | (vertical ? qrcode_getModule(qrcode, i, j): qrcode_getModule(qrcode, j, i));
+                if (j >= 10 && (bits == 0x05D || bits == 0x5D0)) { result += 40; }
+            }
+        }
+    }
+
+    int black = 0;
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) { black += qrcode_getModule(qrcode, x, y); }
+    }
+    int total = size * size;
+    for (int k = 0; black * 20 < (9 - k) * total || black * 20 > (11 + k) * total; k++) { result += 10; }
+
+    return result;
+}
+
+// Scores random and adversarial grids of several sizes (including runs and finder-like
+// patterns across the 64-bit words) against referencePenalty, and checks that each stops
+// early only once the score reaches the limit
+static void testPenalty(int *passed, int *total) {
+    const uint8_t sizes[] = { 21, 57, 61, 65, 69, 125, 177 };
+    const int patterns = 12;
+    const char *finder = "10111010000";
+
+    uint32_t seed = 12345;
+    for (int s = 0; s < 7; s++) {
+        uint8_t size = sizes[s];
+        std::vector<uint8_t> modules((size * size + 7) / 8);
+        QRCode qrcode = { 0 };
+        qrcode.size = size;
+        qrcode.modules = &modules[0];
+
+        for (int pattern = 0; pattern < patterns; pattern++) {
+            std::fill(modules.begin(), modules.end(), 0);
+            for (int y = 0; y < size; y++) {
+                for (int x = 0; x < size; x++) {
+                    seed = seed * 1103515245 + 12345;
+                    bool dark;
+                    switch (pattern) {
+                        case 0: dark = (seed >> 16) & 1; break;                         // Random
+                        case 1: dark = ((seed >> 16) % 10) < 2; break;                  // Random, mostly light
+                        case 2: dark = true; break;                                     // All dark
+                        case 3: dark = false; break;                                    // All light
+                        case 4: dark = (x + y) % 2; break;                              // Checkerboard
+                        case 5: dark = (y / 3) % 2; break;                              // Row stripes
+                        case 6: dark = (x / 7) % 2; break;                              // Column stripes
+                        case 7: dark = finder[(x + y) % 11] == '1'; break;              // Finder-like, both ways
+                        case 8: dark = finder[x % 11] == '1'; break;                    // Finder-like in rows
+                        case 9: dark = (x >= 58 && x < 70) || (y >= 58 && y < 70); break; // Runs across words
+                        case 10: dark = finder[(x + 5) % 11] == '1' && y % 2; break;      // Finder-like, alternate rows
+                        default: dark = (x / 2 + y / 2) % 2; break;                     // 2x2 blocks
+                    }
+                    if (dark) { modules[(y * size + x) / 8] |= 0x80 >> ((y * size + x) % 8); }
+                }
+            }
+
+            uint32_t expected = referencePenalty(&qrcode);
+            bool ok = (qrcode_getPenaltyScore(&qrcode, UINT32_MAX) == expected);
+
+            const uint32_t limits[] = { 0, 1, expected / 2, expected - 1, expected, expected + 1, expected + 1000 };
+            for (int i = 0; i < 7; i++) {
+                uint32_t limit = limits[i];
+                uint32_t score = qrcode_getPenaltyScore(&qrcode, limit);
+                if (expected < limit ? score != expected: score < limit) { ok = false; }
+            }
+
+            if (ok) {
+                (*passed)++;
+            } else {
+                printf("Failed penalty: size=%d, pattern=%d, expected=%u\n", size, pattern, expected);
+            }
+            (*total)++;
+        }
+    }
+}
+
 int main() {
-    std::clock_t t0, totalNayuki, totalRicMoo;
+    std::clock_t t0, totalNayuki = 0, totalRicMoo = 0;
 
     int total = 0, passed = 0;
     for (char version = 1; version <= 40; version++) {
@@ -69,6 +1201,64 @@ int main() {
                 totalRicMoo += std::clock() - t0;
 
                 uint32_t badModules = check(nayuki, &ricmoo);
+
+                QRCodeOptions options = { 0 };
+                options.executor = reverseExecutor;
+                if (!checkOptions(&ricmoo, version, ecc, data, &options)) { badModules++; }
+
+                // With the scratch buffers in a workspace of exactly the size asked for (serially
+                // and through the executor), and one too small
+                std::vector<uint8_t> workspace(qrcode_getWorkspaceSize(version, &options));
+                options.workspace = &workspace[0];
+                options.workspaceSize = workspace.size();
+                if (!checkOptions(&ricmoo, version, ecc, data, &options)) { badModules++; }
+                options.executor = NULL;
+                options.workspaceSize = qrcode_getWorkspaceSize(version, &options);
+                if (!checkOptions(&ricmoo, version, ecc, data, &options)) { badModules++; }
+                options.workspaceSize--;
+                QRCode small;
+                if (qrcode_initBytesWithOptions(&small, ricmooBytes, version, ecc, (const uint8_t*)data, strlen(data), &options) != QRCODE_ERROR_INVALID_ARGUMENT) { badModules++; }
+                options.workspace = NULL;
+
+                // Each fixed mask matches Nayuki forced to it, and the fast policy picks the first
+                // of its candidates (0, 2, 4 and 6) with the lowest penalty, which then matches
+                // Nayuki forced to that mask (the same way through the executor)
+                options.maskPolicy = MASK_FIXED;
+                std::vector<qrcodegen::QrSegment> segs(qrcodegen::QrSegment::makeSegments(data));
+                uint8_t bestMask = 0;
+                uint32_t bestPenalty = UINT32_MAX;
+                for (uint8_t mask = 0; mask < 8; mask++) {
+                    options.fixedMask = mask;
+                    const qrcodegen::QrCode fixed = qrcodegen::QrCode::encodeSegments(segs, *errCorLvl, version, version, mask, false);
+                    QRCode qrcode;
+                    qrcode_initBytesWithOptions(&qrcode, ricmooBytes, version, ecc, (const uint8_t*)data, strlen(data), &options);
+                    if (qrcode.mask != mask || check(fixed, &qrcode) != 0) { badModules++; }
+
+                    uint32_t penalty = referencePenalty(&qrcode);
+                    if (mask % 2 == 0 && penalty < bestPenalty) {
+                        bestMask = mask;
+                        bestPenalty = penalty;
+                    }
+                }
+                options.fixedMask = 8;
+                if (qrcode_initBytesWithOptions(&small, ricmooBytes, version, ecc, (const uint8_t*)data, strlen(data), &options) != QRCODE_ERROR_INVALID_ARGUMENT) { badModules++; }
+
+                options.maskPolicy = MASK_FAST;
+                QRCode fast;
+                qrcode_initBytesWithOptions(&fast, ricmooBytes, version, ecc, (const uint8_t*)data, strlen(data), &options);
+                const qrcodegen::QrCode fastNayuki = qrcodegen::QrCode::encodeSegments(segs, *errCorLvl, version, version, bestMask, false);
+                if (fast.mask != bestMask || check(fastNayuki, &fast) != 0) { badModules++; }
+                options.executor = reverseExecutor;
+                if (!checkOptions(&fast, version, ecc, data, &options)) { badModules++; }
+                options.maskPolicy = MASK_BEST;
+                options.executor = NULL;
+                qrcode_initText(&ricmoo, ricmooBytes, version, ecc, data);
+
+#if USE_PTHREADS
+                options.executor = qrcode_threadExecutor;
+                if (!checkOptions(&ricmoo, version, ecc, data, &options)) { badModules++; }
+#endif
+
                 if (badModules) {
                     printf("Failed test case: version=%d, ecc=%d, data=\"%s\", faliured=%d\n", version, ecc, data, badModules);
                 } else {
@@ -80,6 +1270,95 @@ int main() {
         }
     }
 
+    testModes(&passed, &total);
+    testPenalty(&passed, &total);
+
+    const char *texts[] = { "HELLO", "Hello", "1234" };
+    testBatch(texts, 3, 1, &passed, &total);
+#if USE_PTHREADS
+    testBatch(texts, 3, 7, &passed, &total);
+#endif
+
+    // Lengths around several version boundaries, for each mode, and one too long for any
+    std::string numeric(700, '7'), alphanumeric(400, 'Q'), bytes(1200, 'q'), tooLong(3000, 'q');
+    const char *autoTexts[] = { "HELLO", "Hello", "1234", numeric.c_str(), alphanumeric.c_str(), bytes.c_str(), tooLong.c_str() };
+    testAutoVersion(autoTexts, 7, &passed, &total);
+
+    std::string mixed;
+    for (int i = 0; i < 40; i++) { mixed += "https://example.com/t/" + std::to_string(1234567890123LL * (i + 1)) + "?Q=ABC-" + std::to_string(i) + "&"; }
+    const std::string segmentTexts[] = {
+        "0", "1234", "HELLO", "Hello",
+        "https://example.com/track/12345678901234567890",
+        "ABC123456789012345678901234567890xyz",
+        "HELLO world 0123456789 HELLO WORLD 9876543210",
+        "0123456789ABCDEFGHIJ0123456789abcdefghij0123456789",
+        mixed, tooLong
+    };
+    testSegments(segmentTexts, 10, true, false, &passed, &total);
+
+    // Shift JIS text: the example from the standard, many characters across both Kanji
+    // ranges, the range boundaries, and Kanji mixed with the other modes
+    std::string kanji;
+    for (int i = 0; i < 600; i++) {
+        uint8_t first = (i % 2) ? 0x88 + (i * 7) % 24: 0xE0 + (i * 5) % 11;
+        uint8_t second = 0x40 + (i * 13) % 189;
+        if (second == 0x7F) { second++; }
+        kanji += (char)first;
+        kanji += (char)second;
+    }
+    const std::string kanjiTexts[] = {
+        "\x93\x5F\xE4\xAA",
+        kanji.substr(0, 40), kanji.substr(0, 400), kanji,
+        "\x81\x40\x9F\xFC\xE0\x40\xEB\xBF",
+        "\x81\x40\xEB\xC0\x81\x7F\x9F\xFC",
+        "ABC-" + kanji.substr(0, 20) + "1234567890123456" + kanji.substr(20, 20) + "abc " + kanji.substr(40, 4),
+        "https://example.com/" + kanji.substr(0, 60) + "/0123456789012345678901234567890"
+    };
+    testSegments(kanjiTexts, 8, false, false, &passed, &total);
+    testSegments(kanjiTexts, 8, false, true, &passed, &total);
+    testSegments(kanjiTexts, 8, true, true, &passed, &total);
+
+    // Data fed in pieces, with the options which change how it is encoded
+    QRCodeOptions streamOptions = { 0 };
+    testStream(segmentTexts, 10, NULL, &passed, &total);
+    streamOptions.optimizeSegments = true;
+    streamOptions.kanji = true;
+    streamOptions.boostEcc = true;
+    streamOptions.eci = ECI_SHIFT_JIS;
+    testStream(kanjiTexts, 8, &streamOptions, &passed, &total);
+
+    // UTF-8 text, including byte lengths that only fit version 1 (low) without the header
+    std::string utf8;
+    for (int i = 0; i < 200; i++) { utf8 += "Gr\xC3\xBC\xC3\x9F \xE2\x82\xAC" + std::to_string(i) + " "; }
+    std::string fits17(17, 'q'), fits16(16, 'q');
+    const char *eciTexts[] = { "HELLO", "1234", "Gr\xC3\xBC\xC3\x9F Gott \xE2\x82\xAC", fits16.c_str(), fits17.c_str(), utf8.c_str(), tooLong.c_str() };
+    testEci(eciTexts, 7, &passed, &total);
+
+    // Longer than any single symbol (at the locked version), for the byte and numeric modes
+    std::string sequenceBytes, sequenceDigits;
+    for (int i = 0; sequenceBytes.size() < (LOCK_VERSION ? 300: 6000); i++) { sequenceBytes += "Structured append part " + std::to_string(i) + "; "; }
+    for (int i = 0; sequenceDigits.size() < (LOCK_VERSION ? 500: 9000); i++) { sequenceDigits += std::to_string(1234567 * (i + 1)); }
+    const std::string sequenceTexts[] = { "HELLO", sequenceBytes, sequenceDigits };
+    testStructuredAppend(sequenceTexts, 3, &passed, &total);
+
+    // Images (raster, vector and text) of the smallest and largest versions (or the locked one)
+    const uint8_t imageVersions[] = { LOCK_VERSION ? LOCK_VERSION: 1, LOCK_VERSION ? LOCK_VERSION: 40 };
+    for (int i = 0; i < 2; i++) {
+        QRCode qrcode;
+        std::vector<uint8_t> qrcodeBytes(qrcode_getBufferSize(imageVersions[i]));
+        qrcode_initText(&qrcode, &qrcodeBytes[0], imageVersions[i], ECC_LOW, "HELLO");
+        testImages(&qrcode, &passed, &total);
+        testVectors(&qrcode, &passed, &total);
+        testText(&qrcode, &passed, &total);
+    }
+
     printf("Tests complete: %d passed (out of %d)\n", passed, total);
     printf("Timing: Nayuki=%lu, RicMoo=%lu\n", totalNayuki, totalRicMoo);
+
+    uint32_t hits, misses;
+    qrcode_getGeneratorStats(&hits, &misses);
+    printf("Generator polynomials: hits=%u, misses=%u\n", hits, misses);
+    if (RS_LOOKUP_TABLES && misses != 0) { passed = -1; }
+
+    return (passed == total) ? 0: 1;
 }